@@ -1,13 +1,17 @@
 #include "common/providers.hpp"
 #include "common/player.hpp"
+#include "common/cache.hpp"
+#include "common/scheduler.hpp"
 #include "common/app.hpp"
 
 #include <QDesktopServices>
 #include <QJsonDocument>
 #include <QJsonObject>
 #include <QJsonArray>
+#include <QInputDialog>
 #include <QFontDialog>
 #include <QMessageBox>
+#include <QTimerEvent>
 #include <QKeyEvent>
 #include <QMenuBar>
 
@@ -26,6 +30,21 @@ App::App(QWidget *p):QMainWindow(p){
 
     setMinimumSize(640,480);
 
+    //Cache for the shared manager
+    disk_cache = new HttpDiskCache(this);
+    manager.setCache(disk_cache);
+    connect(&manager,&QNetworkAccessManager::finished,disk_cache,&HttpDiskCache::replyFinished);
+    //Compile the xpath of the providers once
+    PreloadXPaths();
+    //Open the connections before the first request
+    ConnectionWarmer::instance()->warm(&manager);
+    //Guess what the user will open
+    speculator = new SeasonSpeculator(&manager,this);
+    connect(speculator,&SeasonSpeculator::seasonReady,this,[this](const QString &,const SeasonInfo &info){
+        userEpisodeInfoReady(info);
+    });
+    connect(speculator,&SeasonSpeculator::seasonFailed,this,&App::requestSeason);
+
     showMaximized();
 
     //--Connect to the signal
@@ -36,8 +55,20 @@ App::App(QWidget *p):QMainWindow(p){
 #endif
     connect(video_chooser,&VideoChooser::userLinkHovered,[this](const QUrl &link){
         status_bar->showMessage(link.toString());
+        if(link.toString().startsWith("https://www.bilibili.com/bangumi/play/")){
+            //The user may open it,the idle connections are closed in a while
+            ConnectionWarmer::instance()->warm(&manager);
+        }
+        speculator->hover(link);
     });
     connect(video_chooser,&VideoChooser::userOpenVideo,this,&App::userOpenVideo);
+    connect(video_chooser,&VideoChooser::seasonCaptured,this,[this](const QStringList &ids,const QByteArray &data){
+        //Only the season of the current page
+        captured.clear();
+        for(const auto &id : ids){
+            captured.insert(id,data);
+        }
+    });
     //Add some menu / action
     QAction *back_action = menu_bar->addAction("回到主页面");
     connect(back_action,&QAction::triggered,[this](){
@@ -55,6 +86,8 @@ App::App(QWidget *p):QMainWindow(p){
             QMessageBox::information(this,"打开失败","请手动打开链接：" + url.toString());
         }
     });
+    QAction *stats_action = config_menu->addAction("网络统计");
+    connect(stats_action,&QAction::triggered,this,&App::showNetworkStats);
     QAction *about_action = config_menu->addAction("关于");
     connect(about_action,&QAction::triggered,[this](){
         QMessageBox::about(nullptr,"关于",R"(QBilibili Player author: BusyStduent)");
@@ -62,15 +95,35 @@ App::App(QWidget *p):QMainWindow(p){
 }
 App::~App(){
 
+}
+void App::showNetworkStats(){
+    qint64 requests = disk_cache->requestCount();
+    qint64 hits = disk_cache->hitCount();
+    QString text = QString("请求数: %1\n缓存命中: %2 (%3%)\n节省流量: %4 KB\n缓存大小: %5 KB")
+        .arg(requests)
+        .arg(hits)
+        .arg(requests > 0 ? hits * 100 / requests : 0)
+        .arg(disk_cache->bytesSaved() / 1024)
+        .arg(disk_cache->cacheSize() / 1024);
+    auto segments = SegmentCache::instance();
+    text += QString("\n\n分段缓存命中: %1\n分段节省流量: %2 KB\n分段缓存大小: %3 KB")
+        .arg(segments->hitCount())
+        .arg(segments->bytesSaved() / 1024)
+        .arg(segments->cacheSize() / 1024);
+    text += "\n\n" + SpeculationStats::instance()->stats();
+    text += "\n\n请求调度:\n" + NetworkScheduler::instance()->stats();
+    text += "\n\nXPath:\n" + XPathStats();
+    QMessageBox::information(this,"网络统计",text);
 }
 //--Handle the signal
 void App::userOpenVideo(const QUrl &url){
     fetchEpisodeInfo(url);
 }
-void App::userEpisodeInfoReady(const SeasonInfo &video_info){
+VideoBroswer *App::userEpisodeInfoReady(const SeasonInfo &video_info){
     //Receive it from the signal we can use it
     VideoBroswer *video_broswer = new VideoBroswer(this,video_info);
     video_broswer->show();
+    return video_broswer;
 }
 
 //--Video Chooser
@@ -89,52 +142,121 @@ void VideoChooser::linkHovered(const QUrl &link){
     hovered_url = link;
     emit userLinkHovered(link);
 }
-
-//--Video resolver
-void App::replyFinished(QNetworkReply *reply){
-    reply->deleteLater();
-
-    qDebug() << "Reply Finished:" << reply->url();
-    if(reply->error()){
-        //Notify the user
-        qDebug() << "Error:" << reply->errorString();
+/**
+ * @brief Read the season from the state of the play page,
+ *        return it in the shape of the season api or an empty string
+ * 
+ */
+static const char *CaptureSeasonScript = R"JS(
+(function(){
+    //Map to the shape of the pgc season api
+    function season(m,eps){
+        return {
+            type: m.ssType || m.season_type || m.type,
+            season_id: m.season_id || m.ssId,
+            season_title: m.season_title || m.title,
+            episodes: eps.map(function(ep){
+                return {
+                    id: ep.id || ep.ep_id,
+                    aid: ep.aid,
+                    cid: ep.cid,
+                    title: ep.title,
+                    subtitle: ep.long_title || ep.subtitle || "",
+                    cover: ep.cover,
+                    badge: ep.badge || ""
+                };
+            })
+        };
+    }
+    function result(){
+        var s = window.__INITIAL_STATE__;
+        if(s && s.mediaInfo && s.epList){
+            return season(s.mediaInfo,s.epList);
+        }
+        var n = document.getElementById("__NEXT_DATA__");
+        if(n){
+            var queries = JSON.parse(n.textContent).props.pageProps.dehydratedState.queries;
+            for(var i = 0;i < queries.length;i++){
+                var d = queries[i].state.data;
+                if(d && d.seasonInfo && d.seasonInfo.mediaInfo && d.seasonInfo.mediaInfo.episodes){
+                    var m = d.seasonInfo.mediaInfo;
+                    return season(m,m.episodes);
+                }
+            }
+        }
+        return null;
+    }
+    try{
+        var r = result();
+        return r ? JSON.stringify({code: 0,result: r}) : "";
+    }
+    catch(e){
+        return "";
+    }
+})()
+)JS";
+void VideoChooser::pageLoaded(bool ok){
+    if(!ok || !url().toString().startsWith("https://www.bilibili.com/bangumi/play/")){
         return;
     }
-    QJsonDocument json_doc = QJsonDocument::fromJson(reply->readAll());
+    page()->runJavaScript(CaptureSeasonScript,[this](const QVariant &ret){
+        QByteArray data = ret.toString().toUtf8();
+        QJsonDocument json_doc = QJsonDocument::fromJson(data);
+        if(json_doc.isNull()){
+            return;
+        }
+        QJsonValue result = json_doc["result"];
+        QStringList ids;
+        ids.push_back("ss" + QString::number(result["season_id"].toInt()));
+        for(auto _ep : result["episodes"].toArray()){
+            auto ep = _ep.toObject();
+            int id = ep.contains("id") ? ep["id"].toInt() : ep["ep_id"].toInt();
+            ids.push_back("ep" + QString::number(id));
+        }
+        vbrowserDebug() << "Season captured from the page" << ids.size() << "ids";
+        emit seasonCaptured(ids,data);
+    });
+}
+
+//--Video resolver
+/**
+ * @brief Parse the response of the season api
+ * 
+ */
+static bool ParseSeason(const QByteArray &data,SeasonInfo *out){
+    QJsonDocument json_doc = QJsonDocument::fromJson(data);
     if(json_doc.isNull()){
         //Notify the user
         qDebug() << "Error: Invalid JSON";
-        return;
+        return false;
     }
 
     //OK Parse the JSON
     if(json_doc["code"].toInt() != 0){
         //Notify the user
         qDebug() << "Error:" << json_doc["message"].toString();
-        return;
+        return false;
     }
-    QJsonValue data = json_doc["result"];
-    if(data.isNull()){
+    QJsonValue result = json_doc["result"];
+    if(result.isNull()){
         //Notify the user
         qDebug() << "Error: Invalid JSON";
-        return;
+        return false;
     }
 
-    int type = data["type"].toInt();
+    int type = result["type"].toInt();
     if(type != int(VideoType::Anime)){
         //Unsupported video type
         qDebug() << "Error: Unsupported video type";
-        return;
+        return false;
     }
 
-    SeasonInfo sinfo;
-
-    sinfo.season_title = data["season_title"].toString();
-    sinfo.season_id = data["season_id"].toInt();
+    out->season_title = result["season_title"].toString();
+    out->season_id = result["season_id"].toInt();
 
-    qDebug() << "Season:" << sinfo.season_title << sinfo.season_id;
+    qDebug() << "Season:" << out->season_title << out->season_id;
 
-    for(auto _ep : data["episodes"].toArray()){
+    for(auto _ep : result["episodes"].toArray()){
         auto ep = _ep.toObject();
 
         EpisodeInfo info;
@@ -145,24 +267,23 @@ void App::replyFinished(QNetworkReply *reply){
         info.cover_image = ep["cover"].toString();
         info.need_pay = ep["badge"].toString() == "会员";
         info.badge = ep["badge"].toString();
-        sinfo.episodes.append(info);
+        out->episodes.append(info);
 
         qDebug() << "Episode:" << info.aid << info.cid << info.title << info.need_pay;
     }
-    //Notify the user
-    userEpisodeInfoReady(sinfo);
+    return true;
 }
-void App::fetchEpisodeInfo(const QUrl &url){
-    //First extra id from url
+/**
+ * @brief Get the id in the url (ep123 / ss123)
+ * 
+ */
+static QString SeasonIdOf(const QUrl &url){
     QString id = url.toString().split("/").last();
     //Remove ? if it exists
-    id = id.split("?").first();
-
-    qDebug() << "Fetch Video Info:" << id;
-
-    QNetworkRequest request;
+    return id.split("?").first();
+}
+static QNetworkRequest SeasonRequest(const QString &id){
     QUrl req_url;
-
     if(id.startsWith("ep")){
         //Episode
         req_url = QUrl("https://api.bilibili.com/pgc/view/web/season?ep_id=" + id.right(id.length() - 2));
@@ -171,18 +292,233 @@ void App::fetchEpisodeInfo(const QUrl &url){
         //season
         req_url = QUrl("https://api.bilibili.com/pgc/view/web/season?season_id=" + id.right(id.length() - 2));
     }
-    request.setUrl(req_url);
+    QNetworkRequest request(req_url);
     //Set User-Agent and Referer to cheat the server
     request.setRawHeader("User-Agent",PLAYER_USERAGENT);
     request.setRawHeader("Referer",PLAYER_BILIREFERER);
+    NetworkScheduler::setStage(request,"season");
+    return request;
+}
+//--SeasonSpeculator
+SeasonSpeculator::SeasonSpeculator(QNetworkAccessManager *manager,QObject *parent):
+    QObject(parent),manager(manager){
+
+    sweep_timer = startTimer(PLAYER_SPECULATE_SWEEP * 1000);
+}
+void SeasonSpeculator::hover(const QUrl &link){
+    QString id;
+    if(link.toString().startsWith("https://www.bilibili.com/bangumi/play/")){
+        id = SeasonIdOf(link);
+    }
+    if(id == hovered){
+        return;
+    }
+    //Moved away,wait for the dwell again
+    hovered = id;
+    if(dwell_timer != 0){
+        killTimer(dwell_timer);
+        dwell_timer = 0;
+    }
+    if(!id.isEmpty()){
+        dwell_timer = startTimer(PLAYER_SPECULATE_DWELL);
+    }
+}
+void SeasonSpeculator::timerEvent(QTimerEvent *event){
+    if(event->timerId() == sweep_timer){
+        expire();
+        return;
+    }
+    if(event->timerId() != dwell_timer){
+        QObject::timerEvent(event);
+        return;
+    }
+    killTimer(dwell_timer);
+    dwell_timer = 0;
+    speculate(hovered);
+}
+bool SeasonSpeculator::take(const QString &id){
+    expire();
+    auto iter = seasons.find(id);
+    if(iter == seasons.end()){
+        return false;
+    }
+    seasons.erase(iter);
+    SpeculationStats::instance()->used();
+    return true;
+}
+bool SeasonSpeculator::join(const QString &id){
+    auto iter = fetching.find(id);
+    if(iter == fetching.end()){
+        return false;
+    }
+    //The user is waiting for it now
+    NetworkScheduler::instance()->promote(iter.value(),NetworkScheduler::Metadata);
+    joined.insert(id);
+    SpeculationStats::instance()->used();
+    return true;
+}
+void SeasonSpeculator::expire(){
+    auto now = QDateTime::currentDateTimeUtc();
+    for(auto iter = seasons.begin();iter != seasons.end();){
+        if(iter->time.secsTo(now) >= PLAYER_SPECULATE_TTL){
+            SpeculationStats::instance()->dropped(iter->bytes);
+            iter = seasons.erase(iter);
+        }
+        else{
+            ++iter;
+        }
+    }
+}
+void SeasonSpeculator::speculate(const QString &id){
+    expire();
+    if(seasons.contains(id) || fetching.contains(id)){
+        return;
+    }
+    vbrowserDebug() << "Speculate season" << id;
+    QNetworkRequest request = SeasonRequest(id);
+    NetworkScheduler::setStage(request,"speculate season");
+    auto reply = NetworkScheduler::instance()->get(manager,request,NetworkScheduler::Background);
+    fetching.insert(id,reply);
+    connect(reply,&QNetworkReply::finished,this,[this,reply,id](){
+        seasonFinished(reply,id);
+    });
+}
+void SeasonSpeculator::seasonFinished(QNetworkReply *reply,const QString &id){
+    reply->deleteLater();
+    fetching.remove(id);
+    bool wanted = joined.remove(id);
+
+    SeasonInfo info;
+    QByteArray data = reply->readAll();
+    if(reply->error() || !ParseSeason(data,&info)){
+        if(wanted){
+            emit seasonFailed(id);
+        }
+        return;
+    }
+    SpeculationStats::instance()->fetched(data.size());
+    SeasonCache::instance()->save(id,info);
+    if(wanted){
+        emit seasonReady(id,info);
+    }
+    else{
+        seasons.insert(id,Season{QDateTime::currentDateTimeUtc(),data.size()});
+    }
+
+    //The first episode is the most likely one
+    if(!info.episodes.isEmpty() && !info.episodes[0].need_pay){
+        speculateEpisode(info.episodes[0]);
+    }
+}
+void SeasonSpeculator::speculateEpisode(const EpisodeInfo &episode){
+    //Same keys as BilibiliProvider
+    const QString provider = "Bilibili";
+    auto cache = PlayurlCache::instance();
+    auto key = PlayurlCache::keyOf(provider,episode.aid,episode.cid,QString());
+    QPointer<QNetworkAccessManager> m(manager);
+    cache->get(manager,key,BilibiliProvider::playurlRequest(episode,QString()),this,[this,m,episode,provider](const QByteArray &body,const QString &err){
+        if(!err.isEmpty() || m == nullptr){
+            return;
+        }
+        //Then the video of the resolution selected by default
+        QString qn = BilibiliProvider::defaultResolution(body);
+        if(qn.isEmpty()){
+            return;
+        }
+        auto key = PlayurlCache::keyOf(provider,episode.aid,episode.cid,qn);
+        PlayurlCache::instance()->get(m,key,BilibiliProvider::playurlRequest(episode,qn),this,[](const QByteArray &,const QString &){},true);
+    },true);
+
+    DanmakuCache::instance()->get(manager,episode.cid,this,[](const QByteArray &,const QString &){},true);
+}
+
+void App::replyFinished(QNetworkReply *reply,const QString &id){
+    reply->deleteLater();
+    //The window opened from cache,if any
+    bool from_cache = revalidating.contains(id);
+    auto opened = revalidating.take(id);
+
+    qDebug() << "Reply Finished:" << reply->url();
+    if(reply->error()){
+        //Notify the user
+        qDebug() << "Error:" << reply->errorString();
+        return;
+    }
+    SeasonInfo sinfo;
+    if(!ParseSeason(reply->readAll(),&sinfo)){
+        return;
+    }
+    //Update the cache
+    SeasonInfo cached;
+    bool changed = !SeasonCache::instance()->load(id,&cached) || 
+                   SeasonCache::encode(cached) != SeasonCache::encode(sinfo);
+    if(changed){
+        SeasonCache::instance()->save(id,sinfo);
+    }
+
+    if(from_cache){
+        //Already opened from the cache
+        if(!changed){
+            return;
+        }
+        qDebug() << "Season changed,update it";
+        for(const auto &window : opened){
+            if(window != nullptr){
+                window->updateSeason(sinfo);
+            }
+        }
+        return;
+    }
+    //Notify the user
+    userEpisodeInfoReady(sinfo);
+}
+void App::fetchEpisodeInfo(const QUrl &url){
+    QString id = SeasonIdOf(url);
+
+    qDebug() << "Fetch Video Info:" << id;
 
-    qDebug() << "Request URL:" << req_url;
+    //Already loaded by the page in the chooser
+    SeasonInfo page_info;
+    if(captured.contains(id) && ParseSeason(captured.value(id),&page_info)){
+        qDebug() << "Season from the page:" << page_info.season_title;
+        SeasonCache::instance()->save(id,page_info);
+        userEpisodeInfoReady(page_info);
+        return;
+    }
+
+    //Open it at once from cache,then revalidate it
+    SeasonInfo cached;
+    bool has_cache = SeasonCache::instance()->load(id,&cached);
+    if(has_cache && speculator->take(id)){
+        //Fetched when it was hovered just now
+        qDebug() << "Season from speculation:" << cached.season_title;
+        userEpisodeInfoReady(cached);
+        return;
+    }
+    if(!has_cache && speculator->join(id)){
+        //Opened when the speculative fetch is done
+        return;
+    }
+    if(has_cache){
+        qDebug() << "Season from cache:" << cached.season_title;
+        bool sent = revalidating.contains(id);
+        revalidating[id].push_back(userEpisodeInfoReady(cached));
+        if(sent){
+            //Updated by the revalidation in flight
+            return;
+        }
+    }
+    requestSeason(id);
+}
+void App::requestSeason(const QString &id){
+    QNetworkRequest request = SeasonRequest(id);
+    qDebug() << "Request URL:" << request.url();
 
     //Send it and connect to the signal
-    auto reply = manager.get(request);
+    auto reply = NetworkScheduler::instance()->get(&manager,request,NetworkScheduler::Metadata);
     
-    connect(reply,&QNetworkReply::finished,[this,reply](){
-        replyFinished(reply);
+    connect(reply,&QNetworkReply::finished,[this,reply,id](){
+        replyFinished(reply,id);
     });
 }
 QList<VideoProvider*> App::createProviderList(){
@@ -190,6 +526,12 @@ QList<VideoProvider*> App::createProviderList(){
     providers.push_back(new BilibiliProvider(&manager));
     providers.push_back(new AngelProvider(&manager));
     providers.push_back(new YsjdmProvider(&manager));
+    //Race the providers above
+    providers.push_back(new RaceProvider(&manager,{
+        new BilibiliProvider(&manager),
+        new AngelProvider(&manager),
+        new YsjdmProvider(&manager)
+    }));
     providers.push_back(new LocalProvider(&manager));
     return providers;
 }
@@ -200,16 +542,7 @@ VideoBroswer::VideoBroswer(App *w,const SeasonInfo &info):QMainWindow(w),season(
     ui->setupUi(this);
 
     setWindowTitle(season.season_title);
-
-    int n = 0;
-    for(auto &video : season.episodes){
-        QListWidgetItem *item = new QListWidgetItem(ui->listWidget);
-        item->setText(QString("%1 %2").arg(video.title).arg(video.badge));
-        item->setData(Qt::UserRole,n);//< The index of the video
-        ui->listWidget->addItem(item);
-
-        n += 1;
-    }
+    fillEpisodeList();
     //--Get provider
     providers = w->createProviderList();
     //--Get manager
@@ -227,11 +560,14 @@ VideoBroswer::VideoBroswer(App *w,const SeasonInfo &info):QMainWindow(w),season(
     //--Add player
     video_widget = new Player(this);
     ui->playerBox->insertWidget(0,video_widget);
+    video_widget->mediaPlayer()->setNetworkManager(manager);
     //--Connect to the signal
     connect(video_widget->mediaPlayer(),&MediaPlayer::mediaStatusChanged,this,&VideoBroswer::mediaStatusChanged);
-    connect(video_widget->mediaPlayer(),&MediaPlayer::bufferStatusChanged,this,&VideoBroswer::bufferStatusChanged);
-    connect(video_widget->mediaPlayer(),&MediaPlayer::positionChanged,this,&VideoBroswer::positionChanged);
+    connect(video_widget->mediaPlayer(),&MediaPlayer::bufferLevelChanged,this,&VideoBroswer::bufferLevelChanged);
     connect(video_widget->mediaPlayer(),&MediaPlayer::durationChanged,this,&VideoBroswer::durationChanged);
+    connect(video_widget,&Player::seekTargetChanged,this,&VideoBroswer::seekTargetChanged);
+    //The progress reads from the MediaClock
+    ui_timer = startTimer(100);
     //--Connect control buttons
     connect(ui->fullscreenButton,&QPushButton::clicked,this,&VideoBroswer::doFullScreen);
     connect(ui->playButton,&QPushButton::clicked,this,&VideoBroswer::doPlayButton);
@@ -266,6 +602,15 @@ VideoBroswer::VideoBroswer(App *w,const SeasonInfo &info):QMainWindow(w),season(
         QFont font = dialog.selectedFont();
         video_widget->setFont(font);
     });
+    QAction *buffer_config_action = config_menu->addAction("缓冲窗口设置");
+    connect(buffer_config_action,&QAction::triggered,[this](){
+        auto player = video_widget->mediaPlayer();
+        bool ok = false;
+        int sec = QInputDialog::getInt(this,"缓冲窗口","最多预先缓冲多少秒",player->bufferWindow() / 1000,5,3600,5,&ok);
+        if(ok){
+            player->setBufferWindow(sec * 1000);
+        }
+    });
     //--Layout done
 
     // BilibiliProvider provider;
@@ -286,13 +631,32 @@ VideoBroswer::VideoBroswer(App *w,const SeasonInfo &info):QMainWindow(w),season(
         auto provider = ui->providerBox->currentData().value<VideoProvider*>();
         ui->resolutionBox->clear();
 
+        //The old selection is not wanted anymore,unless the user asked to play it
+        if(!prepared.play && (preparing || (prepared.selected && prepared.index != index))){
+            if(preparing){
+                //Abort its fetchVideo,no double click is resolving along with a pre-roll
+                provider->cancelPending();
+            }
+            preparing = false;
+            dropPrepared();
+        }
+        provider->cancelInfo();
         provider->fetchInfo(season,index);
+
+        //Resolve it once the user stops moving
+        selected_index = index;
+        if(select_timer != 0){
+            killTimer(select_timer);
+        }
+        select_timer = startTimer(PLAYER_SELECT_DWELL);
     });
 }
 
 VideoBroswer::~VideoBroswer(){    
     vbrowserDebug() << "Video Broswer Destroyed";
 
+    dropPrepared();
+
     for(auto p : providers){
         delete p;
     }
@@ -301,6 +665,28 @@ VideoBroswer::~VideoBroswer(){
     ui = nullptr;
 }
 
+void VideoBroswer::fillEpisodeList(){
+    int n = 0;
+    for(auto &video : season.episodes){
+        QListWidgetItem *item = new QListWidgetItem(ui->listWidget);
+        item->setText(QString("%1 %2").arg(video.title).arg(video.badge));
+        item->setData(Qt::UserRole,n);//< The index of the video
+        ui->listWidget->addItem(item);
+
+        n += 1;
+    }
+}
+void VideoBroswer::updateSeason(const SeasonInfo &info){
+    season = info;
+    setWindowTitle(season.season_title);
+
+    //Keep the selection,do not fetch the info again
+    QSignalBlocker blocker(ui->listWidget);
+    int row = ui->listWidget->currentRow();
+    ui->listWidget->clear();
+    fillEpisodeList();
+    ui->listWidget->setCurrentRow(row);
+}
 void VideoBroswer::playerError(QMediaPlayer::Error error){
     if(error){
 
@@ -316,20 +702,57 @@ void VideoBroswer::listItemClicked(QListWidgetItem *item){
     }
 
     int index = item->data(Qt::UserRole).toInt();
+    if(prepared.index == index && prepared.ready){
+        //Already resolved
+        playPrepared();
+        return;
+    }
+    if(prepared.index == index && preparing){
+        //Still resolving,do not send it again
+        prepared.play = true;
+        status_bar->showMessage("Waiting for the video...");
+        return;
+    }
+    if(prepared.index != index){
+        preparing = false;
+        dropPrepared();
+    }
     VideoProvider *provider = ui->providerBox->currentData().value<VideoProvider*>();
+    //Drop the replies of the previous click
+    provider->cancelPending();
+    resolving = index;
+    resolve_key = resolveKey(provider,index);
+
+    VideoResource res;
+    if(!resolve_key.isEmpty() && ProviderRegistry::instance()->findResource(resolve_key,&res)){
+        //Resolved by another window
+        vbrowserDebug() << "Use resolved video" << resolve_key;
+        videoReady(res);
+        return;
+    }
     //Waiting for the signal
     status_bar->showMessage("Waiting for the video...");
     // BilibiliProvider provider;
     provider->fetchVideo(season,index,ui->resolutionBox->currentData().toString());
 }
 void VideoBroswer::videoReady(const VideoResource &res){
+    if(preparing){
+        preparedReady(res);
+        return;
+    }
     vbrowserDebug() << "Video Ready";
+    if(!resolve_key.isEmpty()){
+        ProviderRegistry::instance()->setResource(resolve_key,res);
+        resolve_key.clear();
+    }
     video_widget->play(res);
     //Configure ui
     status_bar->showMessage("VideoReady playing...");
     ui->playButton->setIcon(QIcon(":/icons/pause.png"));
-    //Begin fetch danmaku
-    fetchDanmaku(ui->listWidget->currentItem()->data(Qt::UserRole).toInt());
+    //Begin fetch danmaku,the selection may be moved while resolving
+    playing_index = resolving >= 0 ? resolving : ui->listWidget->currentItem()->data(Qt::UserRole).toInt();
+    resolving = -1;
+    fetchDanmaku(playing_index);
 }
 void VideoBroswer::videoInfoReady(const VideoInfo &info){
     vbrowserDebug() << "Video Info Ready";
@@ -346,9 +769,26 @@ void VideoBroswer::videoInfoReady(const VideoInfo &info){
     }
 
     status_bar->showMessage("VideoInfoReady");
+    if(select_timer == 0){
+        //The selection is already stable,it was waiting for the resolution
+        prepareSelected();
+    }
 }
 void VideoBroswer::videoError(const QString &error){
     vbrowserDebug() << "Video Error:" << error;
+    if(preparing){
+        //Background work,do not bother the user unless it was asked for
+        vbrowserDebug() << "Pre-roll failed";
+        bool wanted = prepared.play;
+        preparing = false;
+        dropPrepared();
+        if(!wanted){
+            return;
+        }
+    }
+    else{
+        resolving = -1;
+    }
     QMessageBox msg;
     
     status_bar->showMessage("Video Error:" + error);
@@ -362,52 +802,39 @@ void VideoBroswer::videoError(const QString &error){
 void VideoBroswer::fetchDanmaku(int n){
     vbrowserDebug() << "Fetch Danmaku for video:" << n;
     int cid = season.episodes[n].cid;
-    //Get danmaku from bilibili
-    QUrl req(QString("https://comment.bilibili.com/%1.xml").arg(cid));
-    QNetworkRequest request(req);
-    request.setRawHeader("User-Agent",PLAYER_USERAGENT);
-    request.setRawHeader("Referer",PLAYER_BILIREFERER);
-    auto reply = manager->get(request);
-
-    //Connect
-    connect(reply,&QNetworkReply::finished,[reply,this](){
-        danmakuReceived(reply);
+    //Get danmaku from bilibili,or the cached one
+    DanmakuCache::instance()->get(manager,cid,this,[this,n](const QByteArray &data,const QString &err){
+        danmakuReceived(data,err,n);
     });
-    vbrowserDebug() << req;
 }
-void VideoBroswer::danmakuReceived(QNetworkReply *reply){
-    reply->deleteLater();        
-    if(reply->error()){
-        vbrowserDebug() << "Fetch Danmaku Error:" << reply->errorString();
-        status_bar->showMessage("Fetch Danmaku Error:" + reply->errorString());
+void VideoBroswer::danmakuReceived(const QByteArray &data,const QString &err,int n){
+    if(!err.isEmpty()){
+        vbrowserDebug() << "Fetch Danmaku Error:" << err;
+        status_bar->showMessage("Fetch Danmaku Error:" + err);
         return;
     }
-    if(reply->attribute(QNetworkRequest::HttpStatusCodeAttribute).toInt() == 302){
-        //Redirect
-        vbrowserDebug() << "Redirect";
-        QUrl redirect = reply->attribute(QNetworkRequest::RedirectionTargetAttribute).toUrl();
-        QNetworkRequest request(redirect);
-        request.setRawHeader("User-Agent",PLAYER_USERAGENT);
-        request.setRawHeader("Referer",PLAYER_BILIREFERER);
-        auto reply = manager->get(request);
-        vbrowserDebug() << redirect;
-        connect(reply,&QNetworkReply::finished,this,[reply,this](){
-            danmakuReceived(reply);
-        });
+
+    QString ret = QString::fromUtf8(data);
+    if(n == prepared.index && n != playing_index){
+        //Keep it until the episode played
+        vbrowserDebug() << "Prepared Danmaku for" << n;
+        prepared.danmaku = ret;
+        return;
+    }
+    if(n != playing_index){
+        vbrowserDebug() << "Drop Danmaku of" << n;
         return;
     }
-
     vbrowserDebug() << "Fetch Danmaku Success";
     status_bar->showMessage("Fetch Danmaku Success");
-    QString ret = reply->readAll();
     //Process it
     playDanmaku(ret);
 }
 void VideoBroswer::playDanmaku(const QString &d){
     video_widget->setDanmaku(d);
 }
-void VideoBroswer::bufferStatusChanged(int percent){
-    status_bar->showMessage(QString("Buffering %1%").arg(percent));
+void VideoBroswer::bufferLevelChanged(qint64 ahead,qint64 window){
+    status_bar->showMessage(QString("Buffered %1s / %2s").arg(ahead / 1000).arg(window / 1000));
 }
 void VideoBroswer::mediaStatusChanged(QMediaPlayer::MediaStatus status){
     if(status == QMediaPlayer::BufferedMedia){
@@ -416,9 +843,19 @@ void VideoBroswer::mediaStatusChanged(QMediaPlayer::MediaStatus status){
     }
     else if(status == QMediaPlayer::StalledMedia){
         vbrowserDebug() << "Begin buffering";
+        auto monitor = video_widget->mediaPlayer()->playbackMonitor();
+        status_bar->showMessage(QString("Stalled %1 times, %2s in total")
+            .arg(monitor->stallCount())
+            .arg(monitor->stallTime() / 1000)
+        );
     }
     else if(status == QMediaPlayer::EndOfMedia){
         vbrowserDebug() << "EndofMedia";
+        if(prepared.ready && prepared.index == playing_index + 1){
+            //Continue to the next episode
+            playPrepared();
+            return;
+        }
         ui->progressSilder->setRange(0,0);
         ui->durationLabel->setText("00:00:00");
         ui->timeLabel->setText("00:00:00");
@@ -432,12 +869,161 @@ void VideoBroswer::durationChanged(qint64 duration){
     }
 }
 void VideoBroswer::positionChanged(qint64 position){
+    if(video_widget->isSeeking()){
+        //Keep showing the seek target
+        return;
+    }
+    if(ui != nullptr && ui->progressSilder->isSliderDown()){
+        //The user is dragging it,keep the drop point
+        return;
+    }
+    if(ui != nullptr){
+        ui->progressSilder->setValue(position);
+        ui->timeLabel->setText(QTime(0,0,0).addMSecs(position).toString("hh:mm:ss"));
+    }
+}
+void VideoBroswer::seekTargetChanged(qint64 position){
     if(ui != nullptr){
         ui->progressSilder->setValue(position);
         ui->timeLabel->setText(QTime(0,0,0).addMSecs(position).toString("hh:mm:ss"));
     }
 }
 
+void VideoBroswer::timerEvent(QTimerEvent *event){
+    if(event->timerId() == select_timer){
+        killTimer(select_timer);
+        select_timer = 0;
+        prepareSelected();
+        return;
+    }
+    if(event->timerId() != ui_timer){
+        QMainWindow::timerEvent(event);
+        return;
+    }
+    auto player = video_widget->mediaPlayer();
+    if(!player->hasMedia()){
+        return;
+    }
+    qint64 time = player->mediaClock()->time();
+    positionChanged(time);
+
+    //Pre-roll the next episode
+    qint64 duration = player->duration();
+    int next = playing_index + 1;
+    //It replaces a prepared selection,the auto-continue needs it
+    if(playing_index >= 0 && next < season.episodes.size() && prepared.index != next && 
+       duration > 0 && time * 100 >= duration * PLAYER_PREROLL_PERCENT){
+        prepareEpisode(next);
+    }
+}
+//--Pre-roll
+void VideoBroswer::prepareEpisode(int n){
+    auto provider = ui->providerBox->currentData().value<VideoProvider*>();
+    if(provider == nullptr || !provider->canPrefetch() || preparing || resolving >= 0){
+        //Its videoReady would be taken as the one the user is waiting for
+        return;
+    }
+    if(!ui->resolutionBox->currentData().isValid()){
+        return;
+    }
+    dropPrepared();
+    vbrowserDebug() << "Pre-roll episode" << n;
+
+    prepared.index = n;
+    prepared.key = resolveKey(provider,n);
+    preparing = true;
+    fetchDanmaku(n);
+
+    VideoResource res;
+    if(ProviderRegistry::instance()->findResource(prepared.key,&res)){
+        preparedReady(res);
+        return;
+    }
+    provider->fetchVideo(season,n,ui->resolutionBox->currentData().toString());
+}
+void VideoBroswer::prepareSelected(){
+    if(selected_index < 0 || selected_index == playing_index || prepared.index == selected_index){
+        return;
+    }
+    //Wait for the pre-roll of the next episode
+    if(preparing){
+        return;
+    }
+    prepareEpisode(selected_index);
+    if(prepared.index == selected_index){
+        prepared.selected = true;
+    }
+}
+void VideoBroswer::preparedReady(const VideoResource &res){
+    preparing = false;
+    if(prepared.index < 0 || res.videos.isEmpty()){
+        return;
+    }
+    vbrowserDebug() << "Pre-roll ready" << prepared.index;
+    ProviderRegistry::instance()->setResource(prepared.key,res);
+    prepared.resource = res;
+    prepared.ready = true;
+    if(prepared.play){
+        playPrepared();
+        return;
+    }
+
+    QNetworkRequest request = res.videos[0].canonicalRequest();
+    if(request.url().isLocalFile()){
+        return;
+    }
+    if(!res.single_video){
+        //Download the first segment into the SegmentCache,the player reads it from there
+        prepared.warm_key = SegmentCache::keyOf(request);
+        SegmentCache::instance()->warm(manager,request);
+        return;
+    }
+    //The single video is read from the begin by the player,a range of it could not be used,
+    //only open the connection
+    QUrl origin;
+    origin.setScheme(request.url().scheme());
+    origin.setHost(request.url().host());
+    origin.setPort(request.url().port());
+    ConnectionWarmer::instance()->warmHost(manager,origin);
+}
+QString VideoBroswer::resolveKey(VideoProvider *provider,int n) const{
+    if(!provider->canPrefetch()){
+        //Picked by the user,do not share it
+        return QString();
+    }
+    return ProviderRegistry::keyOf(provider->name(),season.season_id,n,ui->resolutionBox->currentData().toString());
+}
+void VideoBroswer::dropPrepared(){
+    if(prepared.index >= 0 && prepared.index != playing_index && !prepared.warm_key.isEmpty()){
+        //Never played,the bytes warmed for it are wasted
+        auto cache = SegmentCache::instance();
+        qint64 received = 0;
+        qint64 total = -1;
+        if(cache->progress(prepared.warm_key,&received,&total)){
+            SpeculationStats::instance()->prerollDropped(received);
+            vbrowserDebug() << "Drop pre-roll" << prepared.index << "wasted" << received << "bytes";
+        }
+        //Stop the rest,the .part is kept if it is opened later
+        cache->cancel(prepared.warm_key);
+    }
+    prepared = PreparedEpisode();
+}
+void VideoBroswer::playPrepared(){
+    vbrowserDebug() << "Play pre-roll" << prepared.index;
+    playing_index = prepared.index;
+    ui->listWidget->setCurrentRow(playing_index);
+
+    video_widget->play(prepared.resource);
+    status_bar->showMessage("Continue playing...");
+    ui->playButton->setIcon(QIcon(":/icons/pause.png"));
+    if(prepared.danmaku.isEmpty()){
+        fetchDanmaku(playing_index);
+    }
+    else{
+        playDanmaku(prepared.danmaku);
+    }
+    dropPrepared();
+}
 void VideoBroswer::closeEvent(QCloseEvent *event){
     deleteLater();
 }
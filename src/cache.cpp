@@ -0,0 +1,879 @@
+#include "common/cache.hpp"
+#include "common/scheduler.hpp"
+
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QJsonArray>
+#include <QCryptographicHash>
+#include <QStandardPaths>
+#include <QDataStream>
+#include <QUrlQuery>
+#include <QSaveFile>
+#include <QSettings>
+#include <QFile>
+#include <QDir>
+#include <QTimer>
+#include <QDebug>
+#include <cstring>
+
+PLAYER_NS_BEGIN
+
+//--SpeculationStats
+SpeculationStats *SpeculationStats::instance(){
+    static SpeculationStats stats;
+    return &stats;
+}
+QString SpeculationStats::stats() const{
+    return QString("预取次数: %1\n预取命中: %2 (%3%)\n预取流量: %4 KB\n浪费流量: %5 KB\n预载浪费: %6 KB")
+        .arg(issued)
+        .arg(hits)
+        .arg(issued > 0 ? hits * 100 / issued : 0)
+        .arg(bytes / 1024)
+        .arg(wasted / 1024)
+        .arg(preroll_wasted / 1024);
+}
+
+//--PlayurlCache
+PlayurlCache::PlayurlCache(){
+    startTimer(PLAYER_SPECULATE_SWEEP * 1000);
+}
+PlayurlCache *PlayurlCache::instance(){
+    static PlayurlCache cache;
+    return &cache;
+}
+void PlayurlCache::timerEvent(QTimerEvent *){
+    sweep();
+}
+void PlayurlCache::sweep(){
+    auto now = QDateTime::currentDateTimeUtc();
+    for(auto iter = entries.begin();iter != entries.end();){
+        bool expired = iter->expire <= now;
+        if(iter->speculative && (expired || iter->time.secsTo(now) >= PLAYER_SPECULATE_TTL)){
+            //Guessed wrong,a later use is a normal cache hit
+            SpeculationStats::instance()->dropped(iter->data.size());
+            iter->speculative = false;
+        }
+        if(expired){
+            iter = entries.erase(iter);
+        }
+        else{
+            ++iter;
+        }
+    }
+}
+QString PlayurlCache::keyOf(const QString &provider,int aid,int cid,const QString &qn){
+    return QString("%1/%2/%3/%4").arg(provider).arg(aid).arg(cid).arg(qn);
+}
+void PlayurlCache::get(QNetworkAccessManager *manager,const QString &key,const QNetworkRequest &request,QObject *context,Callback callback,bool speculative){
+    auto iter = entries.find(key);
+    if(iter != entries.end()){
+        if(iter->expire > QDateTime::currentDateTimeUtc()){
+            providerDebug() << "Playurl cache hit" << key;
+            if(iter->speculative && !speculative){
+                iter->speculative = false;
+                SpeculationStats::instance()->used();
+            }
+            //Keep it async like the network
+            QByteArray data = iter->data;
+            QTimer::singleShot(0,context,[callback,data](){
+                callback(data,QString());
+            });
+            return;
+        }
+        if(iter->speculative){
+            SpeculationStats::instance()->dropped(iter->data.size());
+        }
+        entries.erase(iter);
+    }
+
+    auto waiter = pending.find(key);
+    if(waiter != pending.end()){
+        providerDebug() << "Playurl join request" << key;
+        waiter->push_back(Waiter{context,callback});
+        auto spec = speculating.find(key);
+        if(!speculative && spec != speculating.end() && spec.value() != nullptr){
+            //The user is waiting for it now
+            NetworkScheduler::instance()->promote(spec.value(),NetworkScheduler::Playback);
+            spec.value() = nullptr;
+            SpeculationStats::instance()->used();
+        }
+        return;
+    }
+    pending[key].push_back(Waiter{context,callback});
+
+    //The playurl is on the way to the first frame,unless we are guessing
+    auto reply = NetworkScheduler::instance()->get(manager,request,speculative ? NetworkScheduler::Background : NetworkScheduler::Playback);
+    if(speculative){
+        speculating.insert(key,reply);
+    }
+    connect(reply,&QNetworkReply::finished,this,[this,reply,key](){
+        replyFinished(reply,key);
+    });
+}
+void PlayurlCache::replyFinished(QNetworkReply *reply,const QString &key){
+    reply->deleteLater();
+
+    auto waiters = pending.take(key);
+    bool speculative = speculating.contains(key);
+    bool unused = speculating.take(key) != nullptr;
+    QByteArray data;
+    QString err;
+    if(reply->error()){
+        err = reply->errorString();
+    }
+    else{
+        data = reply->readAll();
+        if(speculative){
+            SpeculationStats::instance()->fetched(data.size());
+        }
+        auto json_doc = QJsonDocument::fromJson(data);
+        //Only cache the valid one
+        if(!json_doc.isNull() && json_doc["code"].toInt() == 0){
+            entries.insert(key,Entry{data,expireOf(data),unused,QDateTime::currentDateTimeUtc()});
+        }
+    }
+    for(const auto &w : waiters){
+        if(w.context != nullptr){
+            w.callback(data,err);
+        }
+    }
+}
+QDateTime PlayurlCache::expireOf(const QByteArray &data){
+    auto now = QDateTime::currentDateTimeUtc();
+    auto json_doc = QJsonDocument::fromJson(data);
+    auto durl = json_doc["data"]["durl"].toArray();
+    if(!durl.isEmpty()){
+        QUrl url(durl[0].toObject()["url"].toString());
+        QUrlQuery query(url);
+        bool ok = false;
+        qint64 deadline = query.queryItemValue("deadline").toLongLong(&ok);
+        if(ok){
+            return QDateTime::fromSecsSinceEpoch(deadline - PLAYER_PLAYURL_MARGIN,Qt::UTC);
+        }
+    }
+    return now.addSecs(PLAYER_PLAYURL_TTL);
+}
+
+//--DanmakuCache
+DanmakuCache::DanmakuCache(){
+    startTimer(PLAYER_SPECULATE_SWEEP * 1000);
+}
+DanmakuCache *DanmakuCache::instance(){
+    static DanmakuCache cache;
+    return &cache;
+}
+void DanmakuCache::timerEvent(QTimerEvent *){
+    sweep();
+}
+void DanmakuCache::sweep(){
+    auto now = QDateTime::currentDateTimeUtc();
+    for(auto iter = entries.begin();iter != entries.end();){
+        bool expired = iter->expire <= now;
+        if(iter->speculative && (expired || iter->time.secsTo(now) >= PLAYER_SPECULATE_TTL)){
+            SpeculationStats::instance()->dropped(iter->data.size());
+            iter->speculative = false;
+        }
+        if(expired){
+            iter = entries.erase(iter);
+        }
+        else{
+            ++iter;
+        }
+    }
+}
+void DanmakuCache::get(QNetworkAccessManager *manager,int cid,QObject *context,Callback callback,bool speculative){
+    auto iter = entries.find(cid);
+    if(iter != entries.end()){
+        if(iter->expire > QDateTime::currentDateTimeUtc()){
+            providerDebug() << "Danmaku cache hit" << cid;
+            if(iter->speculative && !speculative){
+                iter->speculative = false;
+                SpeculationStats::instance()->used();
+            }
+            QByteArray data = iter->data;
+            QTimer::singleShot(0,context,[callback,data](){
+                callback(data,QString());
+            });
+            return;
+        }
+        if(iter->speculative){
+            SpeculationStats::instance()->dropped(iter->data.size());
+        }
+        entries.erase(iter);
+    }
+
+    auto waiter = pending.find(cid);
+    if(waiter != pending.end()){
+        waiter->push_back(Waiter{context,callback});
+        if(!speculative && speculating.value(cid)){
+            speculating[cid] = false;
+            SpeculationStats::instance()->used();
+        }
+        return;
+    }
+    pending[cid].push_back(Waiter{context,callback});
+    if(speculative){
+        speculating.insert(cid,true);
+    }
+    send(manager,QUrl(QString("https://comment.bilibili.com/%1.xml").arg(cid)),cid);
+}
+void DanmakuCache::send(QNetworkAccessManager *manager,const QUrl &url,int cid){
+    QNetworkRequest request(url);
+    request.setRawHeader("User-Agent",PLAYER_USERAGENT);
+    request.setRawHeader("Referer",PLAYER_BILIREFERER);
+    NetworkScheduler::setStage(request,"danmaku");
+    //A big xml,do not let it slow down the first frame
+    QPointer<QNetworkAccessManager> m(manager);
+    NetworkScheduler::instance()->enqueue(manager,request,NetworkScheduler::Background,this,[this,m,cid](QNetworkReply *reply){
+        connect(reply,&QNetworkReply::finished,this,[this,m,reply,cid](){
+            replyFinished(m,reply,cid);
+        });
+    });
+}
+void DanmakuCache::replyFinished(QNetworkAccessManager *manager,QNetworkReply *reply,int cid){
+    reply->deleteLater();
+    if(NetworkScheduler::isPreempted(reply)){
+        //Sent again later
+        return;
+    }
+    if(reply->attribute(QNetworkRequest::HttpStatusCodeAttribute).toInt() == 302 && manager != nullptr){
+        QUrl redirect = reply->attribute(QNetworkRequest::RedirectionTargetAttribute).toUrl();
+        providerDebug() << "Danmaku redirect" << redirect;
+        send(manager,reply->url().resolved(redirect),cid);
+        return;
+    }
+
+    auto waiters = pending.take(cid);
+    bool speculative = speculating.contains(cid);
+    bool unused = speculating.take(cid);
+    QByteArray data;
+    QString err;
+    if(reply->error()){
+        err = reply->errorString();
+    }
+    else{
+        data = reply->readAll();
+        if(speculative){
+            SpeculationStats::instance()->fetched(data.size());
+        }
+        //Drop the one expiring first
+        if(entries.size() >= PLAYER_DANMAKU_ENTRIES){
+            auto oldest = entries.begin();
+            for(auto iter = entries.begin();iter != entries.end();++iter){
+                if(iter->expire < oldest->expire){
+                    oldest = iter;
+                }
+            }
+            if(oldest->speculative){
+                SpeculationStats::instance()->dropped(oldest->data.size());
+            }
+            entries.erase(oldest);
+        }
+        auto now = QDateTime::currentDateTimeUtc();
+        entries.insert(cid,Entry{data,now.addSecs(PLAYER_DANMAKU_TTL),unused,now});
+    }
+    for(const auto &w : waiters){
+        if(w.context != nullptr){
+            w.callback(data,err);
+        }
+    }
+}
+
+//--SeasonCache
+//'QBSC'
+static constexpr quint32 SeasonCacheMagic = 0x51425343;
+static constexpr quint16 SeasonCacheVersion = 1;
+
+SeasonCache *SeasonCache::instance(){
+    static SeasonCache cache;
+    return &cache;
+}
+QString SeasonCache::pathOf(const QString &id) const{
+    QString dir = QStandardPaths::writableLocation(QStandardPaths::CacheLocation) + "/seasons";
+    QDir().mkpath(dir);
+    return dir + "/" + id + ".bin";
+}
+QByteArray SeasonCache::encode(const SeasonInfo &info){
+    QByteArray data;
+    QDataStream stream(&data,QIODevice::WriteOnly);
+    stream.setVersion(QDataStream::Qt_5_9);
+
+    stream << SeasonCacheMagic << SeasonCacheVersion;
+    stream << qint32(info.season_id) << info.season_title << info.cover_image;
+    stream << quint32(info.episodes.size());
+    for(const auto &ep : info.episodes){
+        stream << qint32(ep.aid) << qint32(ep.cid);
+        stream << ep.title << ep.subtitle << ep.cover_image << ep.badge << ep.need_pay;
+    }
+    return data;
+}
+bool SeasonCache::decode(const QByteArray &data,SeasonInfo *out){
+    QDataStream stream(data);
+    stream.setVersion(QDataStream::Qt_5_9);
+
+    quint32 magic;
+    quint16 version;
+    stream >> magic >> version;
+    if(magic != SeasonCacheMagic || version != SeasonCacheVersion){
+        return false;
+    }
+    SeasonInfo info;
+    qint32 season_id;
+    quint32 n;
+    stream >> season_id >> info.season_title >> info.cover_image >> n;
+    info.season_id = season_id;
+    for(quint32 i = 0;i < n && stream.status() == QDataStream::Ok;i++){
+        EpisodeInfo ep;
+        qint32 aid,cid;
+        stream >> aid >> cid;
+        stream >> ep.title >> ep.subtitle >> ep.cover_image >> ep.badge >> ep.need_pay;
+        ep.aid = aid;
+        ep.cid = cid;
+        info.episodes.push_back(ep);
+    }
+    if(stream.status() != QDataStream::Ok){
+        return false;
+    }
+    *out = info;
+    return true;
+}
+bool SeasonCache::load(const QString &id,SeasonInfo *out) const{
+    QFile file(pathOf(id));
+    if(!file.open(QIODevice::ReadOnly)){
+        return false;
+    }
+    return decode(file.readAll(),out);
+}
+void SeasonCache::save(const QString &id,const SeasonInfo &info){
+    QSaveFile file(pathOf(id));
+    if(!file.open(QIODevice::WriteOnly)){
+        qDebug() << "Failed to save season cache" << id;
+        return;
+    }
+    file.write(encode(info));
+    file.commit();
+}
+
+//--MatchIndex
+MatchIndex *MatchIndex::instance(){
+    static MatchIndex index;
+    return &index;
+}
+QString MatchIndex::groupOf(const QString &provider,int season_id){
+    return QString("match/%1/%2").arg(provider).arg(season_id);
+}
+bool MatchIndex::find(const QString &provider,int season_id,QString *page,QMap<int,QString> *episodes) const{
+    QSettings settings;
+    settings.beginGroup(groupOf(provider,season_id));
+    *page = settings.value("page").toString();
+    auto map = settings.value("episodes").toMap();
+    settings.endGroup();
+    if(page->isEmpty()){
+        return false;
+    }
+    episodes->clear();
+    for(auto iter = map.begin();iter != map.end();++iter){
+        episodes->insert(iter.key().toInt(),iter.value().toString());
+    }
+    return true;
+}
+void MatchIndex::save(const QString &provider,int season_id,const QString &page,const QMap<int,QString> &episodes){
+    QVariantMap map;
+    for(auto iter = episodes.begin();iter != episodes.end();++iter){
+        map.insert(QString::number(iter.key()),iter.value());
+    }
+    QSettings settings;
+    settings.beginGroup(groupOf(provider,season_id));
+    settings.setValue("page",page);
+    settings.setValue("episodes",map);
+    settings.endGroup();
+}
+void MatchIndex::invalidate(const QString &provider,int season_id){
+    QSettings settings;
+    settings.beginGroup(groupOf(provider,season_id));
+    settings.remove("episodes");
+    settings.endGroup();
+}
+
+//--ProviderRegistry
+ProviderRegistry *ProviderRegistry::instance(){
+    static ProviderRegistry registry;
+    return &registry;
+}
+QString ProviderRegistry::keyOf(const QString &provider,int season_id,int idx,const QString &resolution){
+    return QString("%1/%2/%3/%4").arg(provider).arg(season_id).arg(idx).arg(resolution);
+}
+bool ProviderRegistry::findPages(const QString &provider,int season_id,QMap<int,QString> *out) const{
+    QMutexLocker locker(&mutex);
+    auto iter = pages.find(QString("%1/%2").arg(provider).arg(season_id));
+    if(iter == pages.end()){
+        return false;
+    }
+    *out = iter.value();
+    return true;
+}
+void ProviderRegistry::setPages(const QString &provider,int season_id,const QMap<int,QString> &map){
+    QMutexLocker locker(&mutex);
+    pages.insert(QString("%1/%2").arg(provider).arg(season_id),map);
+}
+void ProviderRegistry::dropPages(const QString &provider,int season_id){
+    QMutexLocker locker(&mutex);
+    pages.remove(QString("%1/%2").arg(provider).arg(season_id));
+}
+bool ProviderRegistry::findResource(const QString &key,VideoResource *out){
+    QMutexLocker locker(&mutex);
+    auto iter = resources.find(key);
+    if(iter == resources.end()){
+        return false;
+    }
+    if(iter->expire <= QDateTime::currentDateTimeUtc()){
+        resources.erase(iter);
+        return false;
+    }
+    *out = iter->resource;
+    return true;
+}
+void ProviderRegistry::setResource(const QString &key,const VideoResource &res){
+    QMutexLocker locker(&mutex);
+    resources.insert(key,Resource{res,QDateTime::currentDateTimeUtc().addSecs(PLAYER_RESOLVED_TTL)});
+}
+
+//--SegmentStream
+SegmentStream::SegmentStream(QObject *parent) : QIODevice(parent){
+    open(QIODevice::ReadOnly);
+}
+void SegmentStream::feed(const QByteArray &data){
+    if(data.isEmpty()){
+        return;
+    }
+    output.append(data);
+    emit readyRead();
+}
+void SegmentStream::end(){
+    if(finished){
+        return;
+    }
+    finished = true;
+    emit readChannelFinished();
+}
+void SegmentStream::fail(const QString &error){
+    if(finished){
+        return;
+    }
+    setErrorString(error);
+    output.clear();
+    finished = true;
+    emit readChannelFinished();
+}
+qint64 SegmentStream::readData(char *data,qint64 max){
+    if(output.isEmpty()){
+        return finished ? -1 : 0;
+    }
+    qint64 n = qMin<qint64>(max,output.size());
+    std::memcpy(data,output.constData(),n);
+    output.remove(0,n);
+    return n;
+}
+
+//--SegmentCache
+SegmentCache *SegmentCache::instance(){
+    static SegmentCache cache;
+    return &cache;
+}
+SegmentCache::SegmentCache(){
+    dir = QStandardPaths::writableLocation(QStandardPaths::CacheLocation) + "/segments";
+    QDir().mkpath(dir);
+
+    //Load the index,the modified time is the last used one of the previous sessions
+    QDir d(dir);
+    for(const auto &info : d.entryInfoList(QDir::Files)){
+        if(info.suffix() != "seg"){
+            //Broken download
+            QFile::remove(info.absoluteFilePath());
+            continue;
+        }
+        entries.insert(info.completeBaseName(),Entry{info.size(),info.lastModified().toMSecsSinceEpoch()});
+        total += info.size();
+    }
+    evict();
+
+    //Playback requests are done,continue
+    connect(NetworkScheduler::instance(),&NetworkScheduler::available,this,&SegmentCache::schedule);
+}
+QString SegmentCache::keyOf(const QNetworkRequest &request){
+    QCryptographicHash hash(QCryptographicHash::Sha1);
+    hash.addData(request.url().toEncoded());
+    hash.addData(request.rawHeader("Range"));
+    return QString::fromLatin1(hash.result().toHex());
+}
+QString SegmentCache::pathOf(const QString &key) const{
+    return dir + "/" + key + ".seg";
+}
+QString SegmentCache::find(const QString &key){
+    auto iter = entries.find(key);
+    if(iter == entries.end()){
+        return QString();
+    }
+    iter->used = QDateTime::currentMSecsSinceEpoch();
+    hits += 1;
+    saved += iter->size;
+    return pathOf(key);
+}
+void SegmentCache::prefetch(QNetworkAccessManager *m,const QList<QNetworkRequest> &requests){
+    manager = m;
+    auto old = queue;
+    queue.clear();
+    for(const auto &request : requests){
+        QString key = keyOf(request);
+        if(entries.contains(key) || downloads.contains(key)){
+            continue;
+        }
+        queue.push_back(Pending{key,request});
+    }
+    //Out of the window,the bytes kept for resuming are useless now
+    for(const auto &p : old){
+        bool kept = false;
+        for(const auto &q : queue){
+            if(q.key == p.key){
+                kept = true;
+                break;
+            }
+        }
+        if(!kept){
+            dropPart(p.key);
+        }
+    }
+    schedule();
+}
+void SegmentCache::warm(QNetworkAccessManager *m,const QNetworkRequest &request){
+    QString key = keyOf(request);
+    if(entries.contains(key) || downloads.contains(key)){
+        return;
+    }
+    start(m,key,request,true);
+}
+void SegmentCache::dropPart(const QString &key){
+    if(!downloads.contains(key)){
+        QFile::remove(pathOf(key) + ".part");
+    }
+}
+SegmentStream *SegmentCache::open(QNetworkAccessManager *m,const QNetworkRequest &request,QObject *parent){
+    QString key = keyOf(request);
+    auto stream = new SegmentStream(parent);
+
+    auto iter = downloads.find(key);
+    if(iter == downloads.end()){
+        //The player is waiting,no limit for it
+        for(int i = 0;i < queue.size();i++){
+            if(queue[i].key == key){
+                queue.removeAt(i);
+                break;
+            }
+        }
+        start(m,key,request,false);
+        iter = downloads.find(key);
+    }
+    else{
+        providerDebug() << "Join segment download" << key;
+        //Someone is waiting for it now
+        NetworkScheduler::instance()->promote(iter.value()->reply,NetworkScheduler::Playback);
+    }
+    //Catch up with the downloaded (or resumed) bytes
+    Download *d = iter.value();
+    if(d->failed){
+        stream->fail("Segment download failed");
+    }
+    d->file->flush();
+    QFile part(d->file->fileName());
+    if(part.open(QIODevice::ReadOnly)){
+        stream->feed(part.readAll());
+    }
+    d->readers.push_back(stream);
+    return stream;
+}
+void SegmentCache::hold(const QString &key,bool on){
+    auto d = downloads.value(key);
+    if(d == nullptr || d->held == on){
+        return;
+    }
+    d->held = on;
+    if(!on){
+        //Take what is waiting in the reply
+        replyReadyRead(d);
+    }
+}
+void SegmentCache::cancel(const QString &key){
+    auto d = downloads.value(key);
+    if(d == nullptr){
+        return;
+    }
+    providerDebug() << "Cancel segment download" << key;
+    d->canceled = true;
+    d->reply->abort();
+}
+bool SegmentCache::progress(const QString &key,qint64 *received,qint64 *total) const{
+    auto iter = entries.find(key);
+    if(iter != entries.end()){
+        *received = iter->size;
+        *total = iter->size;
+        return true;
+    }
+    auto d = downloads.value(key);
+    if(d == nullptr){
+        return false;
+    }
+    *received = d->received;
+    *total = d->total;
+    return true;
+}
+void SegmentCache::start(QNetworkAccessManager *m,const QString &key,const QNetworkRequest &request,bool prefetch){
+    auto d = new Download;
+    d->key = key;
+    d->request = request;
+    d->host = request.url().host();
+    d->file = new QFile(pathOf(key) + ".part");
+    QNetworkRequest req(request);
+    //Continue a preempted download from where it stopped
+    qint64 kept = d->file->exists() ? d->file->size() : 0;
+    qint64 first = 0;
+    qint64 last = -1;
+    QByteArray range = request.rawHeader("Range");
+    if(kept > 0 && range.startsWith("bytes=")){
+        auto parts = range.mid(6).split('-');
+        first = parts.value(0).toLongLong();
+        last = parts.value(1).isEmpty() ? -1 : parts.value(1).toLongLong();
+        if(last >= 0 && first + kept > last){
+            kept = 0;
+        }
+    }
+    if(kept > 0 && (range.isEmpty() || range.startsWith("bytes="))){
+        providerDebug() << "Resume segment download" << key << "from" << kept;
+        d->resumed = kept;
+        req.setRawHeader("Range","bytes=" + QByteArray::number(first + kept) + "-" + (last >= 0 ? QByteArray::number(last) : QByteArray()));
+    }
+    if(!d->file->open(d->resumed > 0 ? QIODevice::Append : (QIODevice::WriteOnly | QIODevice::Truncate))){
+        qDebug() << "Failed to open segment cache" << d->file->fileName();
+    }
+    d->received = d->resumed;
+    if(prefetch){
+        NetworkScheduler::setStage(req,"segment prefetch");
+        d->reply = NetworkScheduler::instance()->get(m,req,NetworkScheduler::Prefetch,true);
+    }
+    else{
+        NetworkScheduler::setStage(req,"segment");
+        d->reply = NetworkScheduler::instance()->get(m,req,NetworkScheduler::Playback);
+    }
+    //Let the socket wait while it is held
+    d->reply->setReadBufferSize(PLAYER_SEGMENT_READ_BUFFER);
+    downloads.insert(key,d);
+    hosts[d->host] += 1;
+
+    connect(d->reply,&QNetworkReply::metaDataChanged,this,[this,d](){
+        replyMetaData(d);
+    });
+    connect(d->reply,&QNetworkReply::readyRead,this,[this,d](){
+        replyReadyRead(d);
+    });
+    connect(d->reply,&QNetworkReply::finished,this,[this,d](){
+        replyFinished(d);
+    });
+}
+void SegmentCache::schedule(){
+    if(manager == nullptr){
+        return;
+    }
+    auto scheduler = NetworkScheduler::instance();
+    for(int i = 0;i < queue.size() && downloads.size() < PLAYER_SEGMENT_PARALLEL && scheduler->canStart(NetworkScheduler::Prefetch);){
+        QString host = queue[i].request.url().host();
+        if(hosts.value(host) >= PLAYER_SEGMENT_HOST_LIMIT){
+            //Try the segments on other hosts
+            i++;
+            continue;
+        }
+        auto pending = queue.takeAt(i);
+        start(manager,pending.key,pending.request,true);
+    }
+}
+void SegmentCache::replyMetaData(Download *d){
+    int status = d->reply->attribute(QNetworkRequest::HttpStatusCodeAttribute).toInt();
+    if(status == 200 && d->resumed > 0){
+        //The Range is ignored,we got the whole body,drop the part we already have
+        //(the file always holds a correct prefix for the readers joining now)
+        providerDebug() << "Segment resume ignored by server" << d->key;
+        d->skip = d->resumed;
+        d->resumed = 0;
+    }
+    if(status == 200 || status == 206){
+        bool ok = false;
+        qint64 length = d->reply->header(QNetworkRequest::ContentLengthHeader).toLongLong(&ok);
+        if(ok){
+            d->total = d->resumed + length;
+        }
+        return;
+    }
+    if(status == 0 || d->failed){
+        return;
+    }
+    //An error page,do not let the decoder see it
+    providerDebug() << "Segment download got status" << status << d->request.url();
+    d->failed = true;
+    for(const auto &reader : d->readers){
+        if(reader != nullptr){
+            reader->fail(QString("HTTP status %1").arg(status));
+        }
+    }
+}
+void SegmentCache::replyReadyRead(Download *d){
+    if(d->held){
+        return;
+    }
+    QByteArray data = d->reply->readAll();
+    if(d->failed){
+        return;
+    }
+    if(d->skip > 0){
+        //The file and the readers already have them
+        qint64 n = qMin<qint64>(d->skip,data.size());
+        data.remove(0,int(n));
+        d->skip -= n;
+    }
+    d->file->write(data);
+    d->received += data.size();
+    for(const auto &reader : d->readers){
+        if(reader != nullptr){
+            reader->feed(data);
+        }
+    }
+}
+void SegmentCache::replyFinished(Download *d){
+    //The rest is in the read buffer,take it even if held
+    d->held = false;
+    replyReadyRead(d);
+    d->reply->deleteLater();
+    downloads.remove(d->key);
+    if(--hosts[d->host] <= 0){
+        hosts.remove(d->host);
+    }
+
+    int status = d->reply->attribute(QNetworkRequest::HttpStatusCodeAttribute).toInt();
+    QString path = pathOf(d->key);
+    d->file->close();
+    if(d->canceled){
+        //Continued from the .part file when it is opened again
+    }
+    else if(NetworkScheduler::isPreempted(d->reply)){
+        //Continue it later from the .part file,no one is reading it
+        queue.push_front(Pending{d->key,d->request});
+    }
+    else if(d->failed || d->reply->error() || (status != 200 && status != 206)){
+        providerDebug() << "Segment download failed" << d->reply->errorString();
+        d->file->remove();
+        for(const auto &reader : d->readers){
+            if(reader != nullptr){
+                reader->fail(d->reply->errorString());
+            }
+        }
+    }
+    else{
+        QFile::remove(path);
+        d->file->rename(path);
+        qint64 size = d->file->size();
+        entries.insert(d->key,Entry{size,QDateTime::currentMSecsSinceEpoch()});
+        total += size;
+        evict();
+        emit segmentReady(d->key);
+    }
+    for(const auto &reader : d->readers){
+        if(reader != nullptr && !d->canceled){
+            reader->end();
+        }
+    }
+    delete d->file;
+    delete d;
+
+    schedule();
+}
+void SegmentCache::evict(){
+    while(total > PLAYER_SEGMENT_CACHE_SIZE && !entries.isEmpty()){
+        auto oldest = entries.begin();
+        for(auto iter = entries.begin();iter != entries.end();++iter){
+            if(iter->used < oldest->used){
+                oldest = iter;
+            }
+        }
+        QFile::remove(pathOf(oldest.key()));
+        total -= oldest->size;
+        entries.erase(oldest);
+    }
+}
+
+//--HttpDiskCache
+HttpDiskCache::HttpDiskCache(QObject *parent) : QNetworkDiskCache(parent){
+    setCacheDirectory(QStandardPaths::writableLocation(QStandardPaths::CacheLocation) + "/http");
+    setMaximumCacheSize(PLAYER_HTTP_CACHE_SIZE);
+}
+qint64 HttpDiskCache::freshnessOf(const QUrl &url){
+    const qint64 hour = 60 * 60;
+    QString host = url.host();
+    QString path = url.path();
+
+    if(path.endsWith(".m3u8")){
+        //Playlist of a finished anime never changes
+        return 24 * hour;
+    }
+    if(host.endsWith("66dm.net")){
+        if(path.startsWith("/playdata/")){
+            return 24 * hour;
+        }
+        //Search / Detail pages
+        return hour;
+    }
+    if(host.endsWith("ysjdm.net")){
+        return hour;
+    }
+    return -1;
+}
+QIODevice *HttpDiskCache::prepare(const QNetworkCacheMetaData &meta){
+    qint64 fresh = freshnessOf(meta.url());
+    if(fresh < 0){
+        return QNetworkDiskCache::prepare(meta);
+    }
+    QNetworkCacheMetaData m(meta);
+    //Range responses are part of a media
+    for(const auto &header : m.rawHeaders()){
+        if(header.first.toLower() == "content-range"){
+            return nullptr;
+        }
+    }
+    //Drop their headers,use our rule
+    QNetworkCacheMetaData::RawHeaderList headers;
+    for(const auto &header : m.rawHeaders()){
+        auto name = header.first.toLower();
+        if(name != "cache-control" && name != "pragma" && name != "expires"){
+            headers.push_back(header);
+        }
+    }
+    m.setRawHeaders(headers);
+    m.setExpirationDate(QDateTime::currentDateTimeUtc().addSecs(fresh));
+    m.setSaveToDisk(true);
+    return QNetworkDiskCache::prepare(m);
+}
+QIODevice *HttpDiskCache::data(const QUrl &url){
+    auto device = QNetworkDiskCache::data(url);
+    if(device != nullptr){
+        saved += device->size();
+    }
+    return device;
+}
+void HttpDiskCache::replyFinished(QNetworkReply *reply){
+    if(reply->url().scheme().startsWith("preconnect")){
+        //From connectToHost,not a request
+        return;
+    }
+    requests += 1;
+    if(reply->attribute(QNetworkRequest::SourceIsFromCacheAttribute).toBool()){
+        hits += 1;
+    }
+}
+
+PLAYER_NS_END
\ No newline at end of file
@@ -6,6 +6,10 @@
 #include <QWebEngineView>
 #include <QMainWindow>
 #include <QStatusBar>
+#include <QDateTime>
+#include <QPointer>
+#include <QHash>
+#include <QSet>
 #include <QUrl>
 
 #include <QtMultimedia/QMediaContent>
@@ -14,9 +18,18 @@
 #include "ui_broswer.h"
 #include "defs.hpp"
 
+//Speculate after the link is hovered this ms
+#define PLAYER_SPECULATE_DWELL 400
+//A speculated season is used without revalidation in this seconds
+#define PLAYER_SPECULATE_TTL 120
+//Count the speculated but unused ones as wasted every this seconds
+#define PLAYER_SPECULATE_SWEEP 30
+
 PLAYER_NS_BEGIN
 
 class Player;
+class VideoBroswer;
+class HttpDiskCache;
 /**
  * @brief Single Episode info
  */
@@ -50,10 +63,13 @@ class VideoResource {
         struct Segment {
             qint64 start;//< Start time of it
             qint64 duration;//< The duration of the segment
+            QUrl key;//< Url of the AES-128 key,empty on not encrypted
+            QByteArray iv;//< IV of the AES-128 key
         };
         
         QList<QMediaContent> videos;
         QList<QMediaContent> audios;
+        QList<QList<QMediaContent>> backups;//< Mirrors of each video,may be empty
 
         QList<Segment> segments;//< The Segment of the video
 
@@ -97,9 +113,85 @@ class VideoProvider : public QObject {
          * @param idx 
          */
         virtual void fetchInfo(const SeasonInfo &season,int idx) = 0;
+        /**
+         * @brief Abort the requests of the previous fetchVideo,their replies are dropped
+         *        so a late one will not emit for the new click
+         * 
+         */
+        virtual void cancelPending();
+        /**
+         * @brief Drop the replies of the previous fetchInfo (the selection moved),
+         *        the fetchVideo in flight is kept
+         * 
+         */
+        void cancelInfo(){
+            info_generation += 1;
+        }
+        /**
+         * @brief Bumped by cancelPending
+         * 
+         */
+        quint64 generation() const {
+            return current_generation;
+        }
+        /**
+         * @brief Bumped by cancelInfo
+         * 
+         */
+        quint64 infoGeneration() const {
+            return info_generation;
+        }
+        /**
+         * @brief Everything received by a reply from get / post,read it instead of readAll,
+         *        the reply may be shared by other callers
+         * 
+         */
+        QByteArray body(QNetworkReply *reply) const {
+            return bodies.value(reply);
+        }
+        /**
+         * @brief Can we resolve the video in background (without user interaction)
+         * 
+         */
+        virtual bool canPrefetch() const {
+            return true;
+        }
+        /**
+         * @brief Allow asking the user (pick one of the search results),
+         *        a non-interactive provider fails on an ambiguous search instead
+         * 
+         */
+        void setInteractive(bool on){
+            interactive = on;
+        }
     protected:
+        /**
+         * @brief Send a request through the provider,identical requests in flight are sent once
+         * 
+         * @param request 
+         * @param cancelable False on a request shared by later fetches (season matching),
+         *                   it is kept by cancelPending
+         * @return The reply in flight if the same request is sent,every caller gets its signals
+         */
+        QNetworkReply *get(const QNetworkRequest &request,bool cancelable = true);
+        QNetworkReply *post(const QNetworkRequest &request,const QByteArray &data,bool cancelable = true);
+        /**
+         * @brief Is the reply from a canceled fetch,check it first in the finished handler
+         * 
+         */
+        bool isStale(QNetworkReply *reply) const;
+
         QString provider_name = "Undefined";
         QNetworkAccessManager *manager;
+        bool interactive = true;
+    private:
+        QNetworkReply *track(QNetworkReply *reply,const QByteArray &key,bool cancelable);
+        QNetworkReply *join(const QByteArray &key,bool cancelable);
+
+        QHash<QByteArray,QNetworkReply*> inflight;
+        QHash<QNetworkReply*,QByteArray> bodies;//< Data of the tracked replies,until they are deleted
+        quint64 current_generation = 1;
+        quint64 info_generation = 1;
 };
 /**
  * @brief Provider from Bilibili
@@ -113,6 +205,20 @@ class BilibiliProvider : public VideoProvider {
 
         void fetchVideo(const SeasonInfo &season,int idx,QStringView resolution) override;
         void fetchInfo(const SeasonInfo &season,int idx) override;
+        /**
+         * @brief Make the playurl request of the episode
+         * 
+         * @param episode 
+         * @param qn The resolution,empty for the info (accept_quality) only
+         */
+        static QNetworkRequest playurlRequest(const EpisodeInfo &episode,const QString &qn);
+        /**
+         * @brief Get the resolution selected by default,the first one without need pay
+         * 
+         * @param body The playurl response
+         * @return empty on not found
+         */
+        static QString defaultResolution(const QByteArray &body);
 };
 /**
  * @brief Provider from local file
@@ -126,6 +232,10 @@ class LocalProvider : public VideoProvider {
 
         void fetchVideo(const SeasonInfo &season,int idx,QStringView resolution) override;
         void fetchInfo(const SeasonInfo &season,int idx) override;
+        //It ask the user to select a file
+        bool canPrefetch() const override {
+            return false;
+        }
 };
 
 class VideoChooser : public QWebEngineView {
@@ -135,6 +245,7 @@ class VideoChooser : public QWebEngineView {
         VideoChooser(QWidget *parent = nullptr) : QWebEngineView(parent) {
             setUrl(QUrl("https://www.bilibili.com/anime"));
             connect(page(),&QWebEnginePage::linkHovered,this,&VideoChooser::linkHovered);
+            connect(page(),&QWebEnginePage::loadFinished,this,&VideoChooser::pageLoaded);
         }
 
         VideoChooser *createWindow(QWebEnginePage::WebWindowType type) override;
@@ -143,10 +254,70 @@ class VideoChooser : public QWebEngineView {
     signals:
         void userOpenVideo(const QUrl &url);
         void userLinkHovered(const QUrl &link);
+        /**
+         * @brief The season data of a loaded play page,in the shape of the season api
+         * 
+         * @param ids The ids it answers (ss123 / ep123)
+         * @param data 
+         */
+        void seasonCaptured(const QStringList &ids,const QByteArray &data);
     private:
+        void pageLoaded(bool ok);
+
         QUrl hovered_url;
 };
 
+/**
+ * @brief Fetch the season,the playurl and the danmaku of its first episode at low priority
+ *        when the user stays on a bangumi link,so a click opens with them in hand
+ * 
+ */
+class SeasonSpeculator : public QObject {
+    Q_OBJECT
+    signals:
+        /**
+         * @brief A joined fetch is done
+         * 
+         */
+        void seasonReady(const QString &id,const SeasonInfo &info);
+        void seasonFailed(const QString &id);
+    public:
+        SeasonSpeculator(QNetworkAccessManager *manager,QObject *parent = nullptr);
+
+        void hover(const QUrl &link);
+        /**
+         * @brief The user opened it
+         * 
+         * @return true if it is fetched by us just now (in the SeasonCache)
+         */
+        bool take(const QString &id);
+        /**
+         * @brief The user opened it while we are fetching it
+         * 
+         * @return true if seasonReady / seasonFailed will be emitted
+         */
+        bool join(const QString &id);
+    protected:
+        void timerEvent(QTimerEvent *event) override;
+    private:
+        void speculate(const QString &id);
+        void seasonFinished(QNetworkReply *reply,const QString &id);
+        void speculateEpisode(const EpisodeInfo &episode);
+        void expire();
+
+        struct Season {
+            QDateTime time;
+            qint64 bytes;
+        };
+        QNetworkAccessManager *manager;
+        QHash<QString,Season> seasons;//< Fetched,not opened yet
+        QHash<QString,QNetworkReply*> fetching;
+        QSet<QString> joined;
+        QString hovered;
+        int dwell_timer = 0;
+        int sweep_timer = 0;
+};
+
 class App : public QMainWindow {
     Q_OBJECT
 
@@ -160,7 +331,7 @@ class App : public QMainWindow {
          * @param url 
          */
         void fetchEpisodeInfo(const QUrl &url);
-        void replyFinished(QNetworkReply *reply);
+        void replyFinished(QNetworkReply *reply,const QString &id);
         /**
          * @brief Create a Provider List object
          * 
@@ -170,14 +341,48 @@ class App : public QMainWindow {
         QNetworkAccessManager *networkManager(){
             return &manager;
         }
+        /**
+         * @brief Show the stats of network (cache etc...)
+         * 
+         */
+        void showNetworkStats();
     private:
         void userOpenVideo(const QUrl &url);
-        void userEpisodeInfoReady(const SeasonInfo &);
+        void requestSeason(const QString &id);
+        VideoBroswer *userEpisodeInfoReady(const SeasonInfo &);
 
         VideoChooser *video_chooser;
         QStatusBar *status_bar;
         QMenuBar *menu_bar;
         QNetworkAccessManager manager;
+        HttpDiskCache *disk_cache;
+        SeasonSpeculator *speculator;
+
+        //Windows opened from the cached season,waiting for the revalidation
+        QHash<QString,QList<QPointer<VideoBroswer>>> revalidating;
+        //Season api bodies captured from the page in the chooser,by the ids
+        QHash<QString,QByteArray> captured;
+};
+
+//Pre-roll the next episode when played this percent
+#define PLAYER_PREROLL_PERCENT 90
+//Resolve the selected episode when the selection stays this ms
+#define PLAYER_SELECT_DWELL 500
+
+/**
+ * @brief Episode resolved before the user play it
+ * 
+ */
+class PreparedEpisode {
+    public:
+        int index = -1;//< -1 on nothing
+        bool ready = false;//< The resource is ready
+        bool play = false;//< The user asked for it,play it once ready
+        bool selected = false;//< For the selection in the list,not the next episode
+        QString key;//< Key in the ProviderRegistry
+        VideoResource resource;
+        QString danmaku;
+        QString warm_key;//< Key of the first segment warmed in the SegmentCache
 };
 
 /**
@@ -197,16 +402,23 @@ class VideoBroswer : public QMainWindow {
          */
         void fetchDanmaku(int n);
         void playDanmaku(const QString &danmaku);
+        /**
+         * @brief Update the season (the cached one is out of date)
+         * 
+         * @param info 
+         */
+        void updateSeason(const SeasonInfo &info);
     private slots:
         void playerError(QMediaPlayer::Error);
         void listItemClicked(QListWidgetItem *item);
-        void danmakuReceived(QNetworkReply *reply);
+        void danmakuReceived(const QByteArray &data,const QString &err,int n);
         //From MediaPlayer
         void mediaStatusChanged(QMediaPlayer::MediaStatus);
-        void bufferStatusChanged(int);
+        void bufferLevelChanged(qint64 ahead,qint64 window);
         //For VideoPlayer
         void durationChanged(qint64);
         void positionChanged(qint64);
+        void seekTargetChanged(qint64);
     private:
         void videoReady(const VideoResource &res);
         void videoInfoReady(const VideoInfo &info);
@@ -216,11 +428,25 @@ class VideoBroswer : public QMainWindow {
         void userEpisodeInfoReady(const SeasonInfo &);
         void closeEvent(QCloseEvent *event) override;
         void keyPressEvent(QKeyEvent *event) override;
+        void timerEvent(QTimerEvent *event) override;
 
         void doFullScreen();
         void doPlayButton();//< Play or pause the video
         void doPause();//< Try to pause or resume the video
         void doVolumeButton();//< Open the volume control dialog
+        void fillEpisodeList();
+        /**
+         * @brief Key of the episode in the ProviderRegistry,empty if it should not be shared
+         * 
+         */
+        QString resolveKey(VideoProvider *provider,int n) const;
+
+        //Pre-roll
+        void prepareEpisode(int n);//< Resolve the video,danmaku and warm it in background
+        void preparedReady(const VideoResource &res);
+        void dropPrepared();//< Drop it and report the cost
+        void playPrepared();
+        void prepareSelected();//< Resolve the selected episode before the double click
 
         SeasonInfo season;
         QMenuBar *menu_bar;
@@ -230,6 +456,16 @@ class VideoBroswer : public QMainWindow {
 
         QList<VideoProvider*> providers;
 
+        int ui_timer = 0;//< Update the progress from the MediaClock
+        int select_timer = 0;//< Waiting the selection to be stable
+        int selected_index = -1;//< Index of the episode selected in the list
+        int playing_index = -1;//< Index of the episode playing
+        QString resolve_key;//< Key of the video the user waiting for
+
+        PreparedEpisode prepared;
+        bool preparing = false;//< Waiting the provider for prepared
+        int resolving = -1;//< The double clicked episode waiting the provider
+
         Ui::BroswerUI *ui;
 }; 
 
@@ -0,0 +1,473 @@
+#pragma once
+
+#include <QNetworkAccessManager>
+#include <QNetworkRequest>
+#include <QNetworkReply>
+#include <QNetworkDiskCache>
+#include <QDateTime>
+#include <QIODevice>
+#include <QPointer>
+#include <QHash>
+#include <QMap>
+#include <QMutex>
+#include <QFile>
+#include <functional>
+
+#include "defs.hpp"
+#include "app.hpp"
+#include "scheduler.hpp"
+
+//Refresh the playurl this seconds before the deadline of cdn
+#define PLAYER_PLAYURL_MARGIN 60
+//Keep the playurl this seconds if no deadline found
+#define PLAYER_PLAYURL_TTL 600
+//Keep a resolved video resource this seconds
+#define PLAYER_RESOLVED_TTL 600
+//Keep the danmaku this seconds
+#define PLAYER_DANMAKU_TTL 600
+//Max danmaku kept in memory
+#define PLAYER_DANMAKU_ENTRIES 8
+//Max bytes of the http disk cache
+#define PLAYER_HTTP_CACHE_SIZE (64 * 1024 * 1024)
+//Max bytes of the segment cache
+#define PLAYER_SEGMENT_CACHE_SIZE (qint64(1024) * 1024 * 1024)
+//Segments downloaded at once
+#define PLAYER_SEGMENT_PARALLEL 4
+//Segments downloaded from a host at once
+#define PLAYER_SEGMENT_HOST_LIMIT 2
+//Bytes a held segment download leaves in its reply
+#define PLAYER_SEGMENT_READ_BUFFER (256 * 1024)
+
+PLAYER_NS_BEGIN
+
+/**
+ * @brief Counters of the speculative fetches (done before the user asked)
+ *
+ */
+class SpeculationStats {
+    public:
+        static SpeculationStats *instance();
+
+        void fetched(qint64 n){
+            issued += 1;
+            bytes += n;
+        }
+        void used(){
+            hits += 1;
+        }
+        void dropped(qint64 n){
+            wasted += n;
+        }
+        //A prepared episode dropped before played,with the bytes warmed for it
+        void prerollDropped(qint64 n){
+            preroll_wasted += n;
+        }
+        QString stats() const;
+    private:
+        qint64 issued = 0;//< Fetches done
+        qint64 hits = 0;//< Used by the user
+        qint64 bytes = 0;//< Bytes fetched
+        qint64 wasted = 0;//< Bytes expired without use
+        qint64 preroll_wasted = 0;//< Bytes warmed for the dropped pre-rolls
+};
+
+/**
+ * @brief Cache of resolved playurl responses,keyed by (provider,aid,cid,qn)
+ *
+ */
+class PlayurlCache : public QObject {
+    Q_OBJECT
+    public:
+        /**
+         * @brief Called with the body of the response,or the error string
+         *
+         */
+        using Callback = std::function<void(const QByteArray &data,const QString &error)>;
+
+        static PlayurlCache *instance();
+        static QString keyOf(const QString &provider,int aid,int cid,const QString &qn);
+        /**
+         * @brief Get the response,it is served from the cache if it is fresh,
+         *        identical lookups in flight share one request
+         *
+         * @param manager
+         * @param key The key from keyOf
+         * @param request The request to send on miss
+         * @param context The callback is dropped if it is destroyed
+         * @param callback
+         * @param speculative Fetched at low priority before the user asked,counted in SpeculationStats
+         */
+        void get(QNetworkAccessManager *manager,const QString &key,const QNetworkRequest &request,QObject *context,Callback callback,bool speculative = false);
+    protected:
+        void timerEvent(QTimerEvent *event) override;
+    private:
+        PlayurlCache();
+
+        struct Entry {
+            QByteArray data;
+            QDateTime expire;
+            bool speculative;//< Not used by the user yet
+            QDateTime time;//< When it is fetched
+        };
+        struct Waiter {
+            QPointer<QObject> context;
+            Callback callback;
+        };
+        /**
+         * @brief Get the expire time from the deadline in the cdn url
+         *
+         */
+        static QDateTime expireOf(const QByteArray &data);
+        void replyFinished(QNetworkReply *reply,const QString &key);
+        /**
+         * @brief Drop the expired entries,count the speculative ones unused in PLAYER_SPECULATE_TTL as wasted
+         *
+         */
+        void sweep();
+
+        QHash<QString,Entry> entries;
+        QHash<QString,QList<Waiter>> pending;
+        QHash<QString,QNetworkReply*> speculating;//< Speculative requests in flight,null after the user joined
+};
+
+/**
+ * @brief Cache of the danmaku xml,keyed by the cid
+ *
+ */
+class DanmakuCache : public QObject {
+    Q_OBJECT
+    public:
+        using Callback = std::function<void(const QByteArray &data,const QString &error)>;
+
+        static DanmakuCache *instance();
+        /**
+         * @brief Get the danmaku,identical lookups in flight share one request
+         *
+         * @param manager
+         * @param cid
+         * @param context The callback is dropped if it is destroyed
+         * @param callback
+         * @param speculative Fetched before the user asked,counted in SpeculationStats
+         */
+        void get(QNetworkAccessManager *manager,int cid,QObject *context,Callback callback,bool speculative = false);
+    protected:
+        void timerEvent(QTimerEvent *event) override;
+    private:
+        DanmakuCache();
+
+        struct Entry {
+            QByteArray data;
+            QDateTime expire;
+            bool speculative;
+            QDateTime time;
+        };
+        struct Waiter {
+            QPointer<QObject> context;
+            Callback callback;
+        };
+        void send(QNetworkAccessManager *manager,const QUrl &url,int cid);
+        void replyFinished(QNetworkAccessManager *manager,QNetworkReply *reply,int cid);
+        void sweep();
+
+        QHash<int,Entry> entries;
+        QHash<int,QList<Waiter>> pending;
+        QHash<int,bool> speculating;//< Speculative requests in flight,false after the user joined
+};
+
+/**
+ * @brief On-disk cache of parsed SeasonInfo,keyed by the id in the url (ep123 / ss123)
+ * 
+ */
+class SeasonCache {
+    public:
+        static SeasonCache *instance();
+
+        bool load(const QString &id,SeasonInfo *out) const;
+        void save(const QString &id,const SeasonInfo &info);
+        /**
+         * @brief Encode / Decode the compact binary format
+         * 
+         */
+        static QByteArray encode(const SeasonInfo &info);
+        static bool       decode(const QByteArray &data,SeasonInfo *out);
+    private:
+        QString pathOf(const QString &id) const;
+};
+
+/**
+ * @brief Persistent map from a bilibili season to the matched page of a scraper provider,
+ *        so the search (and the pick of the user) is done once
+ * 
+ */
+class MatchIndex {
+    public:
+        static MatchIndex *instance();
+
+        /**
+         * @brief Find the match of the season
+         * 
+         * @param provider The provider name
+         * @param season_id 
+         * @param page The detail page url
+         * @param episodes The episode number to url map,empty if the page should be fetched again
+         * @return false if never matched
+         */
+        bool find(const QString &provider,int season_id,QString *page,QMap<int,QString> *episodes) const;
+        void save(const QString &provider,int season_id,const QString &page,const QMap<int,QString> &episodes);
+        /**
+         * @brief Forget the episodes,keep the page (new episodes are out)
+         * 
+         */
+        void invalidate(const QString &provider,int season_id);
+    private:
+        static QString groupOf(const QString &provider,int season_id);
+};
+
+/**
+ * @brief App-level state of the providers,shared by all the broswer windows
+ *        (the provider objects stay per window,their signals are routed to it)
+ * 
+ */
+class ProviderRegistry {
+    public:
+        static ProviderRegistry *instance();
+        static QString keyOf(const QString &provider,int season_id,int idx,const QString &resolution);
+
+        /**
+         * @brief Matched episode pages of a scraper provider
+         * 
+         */
+        bool findPages(const QString &provider,int season_id,QMap<int,QString> *pages) const;
+        void setPages(const QString &provider,int season_id,const QMap<int,QString> &pages);
+        void dropPages(const QString &provider,int season_id);
+        /**
+         * @brief Resolved video of an episode,kept for PLAYER_RESOLVED_TTL
+         * 
+         * @param key The key from keyOf
+         */
+        bool findResource(const QString &key,VideoResource *out);
+        void setResource(const QString &key,const VideoResource &res);
+    private:
+        struct Resource {
+            VideoResource resource;
+            QDateTime expire;
+        };
+        mutable QMutex mutex;
+        QHash<QString,QMap<int,QString>> pages;
+        QHash<QString,Resource> resources;
+};
+
+/**
+ * @brief Sequential device of a segment being downloaded by the SegmentCache
+ *
+ */
+class SegmentStream : public QIODevice {
+    Q_OBJECT
+    public:
+        SegmentStream(QObject *parent = nullptr);
+
+        bool isSequential() const override {
+            return true;
+        }
+        bool atEnd() const override {
+            return finished && output.isEmpty();
+        }
+        qint64 bytesAvailable() const override {
+            return output.size() + QIODevice::bytesAvailable();
+        }
+        /**
+         * @brief Called by the cache
+         *
+         */
+        void feed(const QByteArray &data);
+        void end();
+        /**
+         * @brief The download failed,end it with the error and no data
+         *
+         */
+        void fail(const QString &error);
+    protected:
+        qint64 readData(char *data,qint64 max) override;
+        qint64 writeData(const char *,qint64) override {
+            return -1;
+        }
+    private:
+        QByteArray output;//< Bytes waiting to be read
+        bool finished = false;
+};
+
+/**
+ * @brief On-disk cache of the video segments,files are named by the hash of the request
+ *        and evicted by LRU when it is over PLAYER_SEGMENT_CACHE_SIZE
+ *
+ */
+class SegmentCache : public QObject {
+    Q_OBJECT
+    signals:
+        void segmentReady(const QString &key);
+    public:
+        static SegmentCache *instance();
+        /**
+         * @brief Get the key of the segment,the hash of the url and the range
+         *
+         */
+        static QString keyOf(const QNetworkRequest &request);
+        /**
+         * @brief Find the downloaded segment
+         *
+         * @param key The key from keyOf
+         * @return The local path,empty on not cached
+         */
+        QString find(const QString &key);
+        /**
+         * @brief Is the segment downloaded,not counted as a hit
+         *
+         */
+        bool contains(const QString &key) const {
+            return entries.contains(key);
+        }
+        /**
+         * @brief Download the segments in the window,PLAYER_SEGMENT_PARALLEL at once
+         *        and PLAYER_SEGMENT_HOST_LIMIT per host,the queued ones not in it are dropped
+         *
+         * @param manager
+         * @param requests The segments ahead of the playhead,nearest first
+         */
+        void prefetch(QNetworkAccessManager *manager,const QList<QNetworkRequest> &requests);
+        /**
+         * @brief Download a segment out of the window (the first one of the next episode),
+         *        it is not dropped by prefetch
+         *
+         * @param manager
+         * @param request
+         */
+        void warm(QNetworkAccessManager *manager,const QNetworkRequest &request);
+        /**
+         * @brief Read the segment while it is downloading,it joins the download in flight
+         *        or starts it at once
+         *
+         * @param manager
+         * @param request
+         * @param parent The parent of the stream
+         * @return SegmentStream*
+         */
+        SegmentStream *open(QNetworkAccessManager *manager,const QNetworkRequest &request,QObject *parent = nullptr);
+        /**
+         * @brief Stop reading the download (the buffer window is full),
+         *        the socket waits until it is released
+         *
+         */
+        void hold(const QString &key,bool on);
+        /**
+         * @brief Abort the download (the user is seeking away),the bytes are kept
+         *        in the .part file for resuming,the readers are left without an end
+         *
+         */
+        void cancel(const QString &key);
+        /**
+         * @brief Get how much of the segment is here
+         *
+         * @param key The key from keyOf
+         * @param received Bytes downloaded
+         * @param total Bytes of the segment,-1 on unknown
+         * @return false if it is neither cached nor downloading
+         */
+        bool progress(const QString &key,qint64 *received,qint64 *total) const;
+
+        qint64 hitCount() const {
+            return hits;
+        }
+        qint64 bytesSaved() const {
+            return saved;
+        }
+        qint64 cacheSize() const {
+            return total;
+        }
+    private:
+        SegmentCache();
+
+        struct Entry {
+            qint64 size;
+            qint64 used;//< Last used time in ms
+        };
+        struct Download {
+            QString key;
+            QString host;
+            QNetworkRequest request;
+            QNetworkReply *reply;
+            QFile *file;//< The .part file
+            QList<QPointer<SegmentStream>> readers;
+            bool failed = false;//< Not a media response,nothing is fed
+            qint64 resumed = 0;//< Bytes kept in the .part file from a preempted download
+            qint64 skip = 0;//< Bytes of the body in the .part file already,the server ignored the Range
+            qint64 received = 0;//< Bytes in the .part file
+            qint64 total = -1;//< Bytes of the segment,from the Content-Length
+            bool held = false;//< Not read as the window is full
+            bool canceled = false;//< Aborted by cancel
+        };
+        struct Pending {
+            QString key;
+            QNetworkRequest request;
+        };
+        QString pathOf(const QString &key) const;
+        void start(QNetworkAccessManager *manager,const QString &key,const QNetworkRequest &request,bool prefetch);
+        void schedule();
+        void replyMetaData(Download *d);
+        void dropPart(const QString &key);
+        void replyReadyRead(Download *d);
+        void replyFinished(Download *d);
+        void evict();
+
+        QString dir;
+        QPointer<QNetworkAccessManager> manager;//< Of the last prefetch
+        QHash<QString,Entry> entries;
+        QHash<QString,Download*> downloads;
+        QHash<QString,int> hosts;//< Downloads of each host
+        QList<Pending> queue;
+        qint64 total = 0;
+        qint64 hits = 0;
+        qint64 saved = 0;
+};
+
+/**
+ * @brief Disk cache of the shared manager,the provider sites send poor cache headers,
+ *        so we use our freshness rules for them
+ * 
+ */
+class HttpDiskCache : public QNetworkDiskCache {
+    Q_OBJECT
+    public:
+        HttpDiskCache(QObject *parent = nullptr);
+
+        QIODevice *prepare(const QNetworkCacheMetaData &meta) override;
+        QIODevice *data(const QUrl &url) override;
+        /**
+         * @brief Get how many seconds the url keeps fresh
+         * 
+         * @param url 
+         * @return -1 on using the headers from server
+         */
+        static qint64 freshnessOf(const QUrl &url);
+        /**
+         * @brief Count a finished reply of the manager
+         * 
+         * @param reply 
+         */
+        void replyFinished(QNetworkReply *reply);
+
+        qint64 requestCount() const {
+            return requests;
+        }
+        qint64 hitCount() const {
+            return hits;
+        }
+        qint64 bytesSaved() const {
+            return saved;
+        }
+    private:
+        qint64 requests = 0;
+        qint64 hits = 0;
+        qint64 saved = 0;
+};
+
+PLAYER_NS_END
\ No newline at end of file
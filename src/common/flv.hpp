@@ -0,0 +1,225 @@
+#pragma once
+
+#include <QNetworkAccessManager>
+#include <QNetworkRequest>
+#include <QNetworkReply>
+#include <QSharedPointer>
+#include <QIODevice>
+#include <QHash>
+#include <QList>
+#include <QSet>
+#include <QUrl>
+
+#include "defs.hpp"
+
+//How many bytes we fetch to get the flv header / onMetaData
+#define PLAYER_FLV_HEAD_SIZE (128 * 1024)
+//Bytes a held stream leaves in its reply,the socket is not read when it is full
+#define PLAYER_FLV_READ_BUFFER (256 * 1024)
+
+PLAYER_NS_BEGIN
+
+/**
+ * @brief Keyframe index of a flv file
+ *
+ */
+class FlvIndex {
+    public:
+        struct Keyframe {
+            qint64 time;//< Timestamp of it in ms
+            qint64 position;//< Byte offset of the tag in the file
+        };
+        /**
+         * @brief Parse the begin of a flv file,get the header,onMetaData keyframes
+         *        and the keyframes of the tags inside it
+         *
+         * @param data The first bytes of the file
+         * @return true on the header is valid
+         */
+        bool parseHead(const QByteArray &data);
+        /**
+         * @brief Add a keyframe seen in the downloaded tags
+         *
+         * @param time
+         * @param position
+         */
+        void addKeyframe(qint64 time,qint64 position);
+        /**
+         * @brief Mark the tags from begin to end are parsed without gaps,
+         *        so the keyframes in it are all known
+         *
+         * @param begin Timestamp of the keyframe the parsing started from (0 on the file begin)
+         * @param end Timestamp of the last tag parsed
+         */
+        void addSpan(qint64 begin,qint64 end);
+        /**
+         * @brief Find the nearest keyframe not after the time
+         *
+         * @param time The time in ms
+         * @param out
+         * @return true if found,false if the index does not cover the time
+         */
+        bool find(qint64 time,Keyframe *out) const;
+        /**
+         * @brief Find the nearest keyframe not before the time
+         *
+         * @param time The time in ms
+         * @param out
+         * @return true if found
+         */
+        bool findAfter(qint64 time,Keyframe *out) const;
+        /**
+         * @brief Does the index know all the keyframes from one time to another
+         *        (the whole file with onMetaData keyframes,or a span parsed by the head / a stream)
+         *
+         */
+        bool covers(qint64 from,qint64 to) const;
+        bool covers(qint64 time) const {
+            return covers(time,time);
+        }
+        /**
+         * @brief Get bytes should be put before the tags from a keyframe
+         *        (flv header,onMetaData and the codec sequence headers)
+         *
+         * @return QByteArray
+         */
+        QByteArray header() const {
+            return head;
+        }
+        bool isEmpty() const {
+            return keyframes.isEmpty();
+        }
+    private:
+        struct Span {
+            qint64 begin;
+            qint64 end;
+        };
+        QList<Keyframe> keyframes;//< Sorted by time
+        QList<Span> spans;//< Parsed without gaps,sorted and not overlapped
+        QByteArray head;
+        bool complete = false;//< Has the keyframes table of onMetaData
+};
+
+/**
+ * @brief Cache the index of each flv url
+ *
+ */
+class FlvIndexCache : public QObject {
+    Q_OBJECT
+    signals:
+        void indexReady(const QUrl &url);
+    public:
+        static FlvIndexCache *instance();
+        /**
+         * @brief Find the index of the url
+         *
+         * @return nullptr if it is not ready
+         */
+        QSharedPointer<FlvIndex> find(const QUrl &url) const;
+        /**
+         * @brief Fetch the head of the flv and build a index,do nothing if it is already cached
+         *
+         * @param manager
+         * @param request The request of the video
+         */
+        void fetch(QNetworkAccessManager *manager,const QNetworkRequest &request);
+        /**
+         * @brief Share the index of the url with its mirror (the same file on another host)
+         *
+         */
+        void alias(const QUrl &url,const QUrl &mirror);
+
+        static QUrl keyOf(const QUrl &url){
+            //The query is the token of cdn
+            return url.adjusted(QUrl::RemoveQuery);
+        }
+    private:
+        void headReady(QNetworkReply *reply,const QUrl &key);
+
+        QHash<QUrl,QSharedPointer<FlvIndex>> indexes;
+        QSet<QUrl> fetching;
+};
+
+/**
+ * @brief Sequential device for playing a flv from a keyframe,
+ *        it put the header before the tags and rebase the timestamp,
+ *        the whole file is passed through if it is from the position 0
+ *
+ */
+class FlvStream : public QIODevice {
+    Q_OBJECT
+    public:
+        FlvStream(QNetworkAccessManager *manager,const QNetworkRequest &request,const FlvIndex::Keyframe &from,QObject *parent = nullptr);
+        ~FlvStream();
+
+        /**
+         * @brief Stop reading the reply (the buffer window is full),
+         *        the rest is left in the socket until it is released
+         *
+         */
+        void hold(bool on);
+        bool isHeld() const {
+            return held;
+        }
+        //The download is done
+        bool isFinished() const {
+            return finished;
+        }
+        /**
+         * @brief Stop the download,the device is left open without an end
+         *        (it is replaced by a new one soon)
+         *
+         */
+        void abort();
+        //Bytes read from the reply
+        qint64 received() const {
+            return received_bytes;
+        }
+        //Timestamp of the last tag received,-1 on nothing
+        qint64 receivedTime() const {
+            return span_end;
+        }
+        //Bytes per ms of the media received,0 on unknown
+        qreal bitrate() const {
+            qint64 span = span_end - span_begin;
+            return span > 0 ? qreal(received_bytes) / span : 0;
+        }
+
+        bool isSequential() const override {
+            return true;
+        }
+        bool atEnd() const override {
+            return finished && output.isEmpty();
+        }
+        qint64 bytesAvailable() const override {
+            return output.size() + QIODevice::bytesAvailable();
+        }
+        //Start time of the stream
+        qint64 startTime() const {
+            return base;
+        }
+    protected:
+        qint64 readData(char *data,qint64 max) override;
+        qint64 writeData(const char *,qint64) override {
+            return -1;
+        }
+    private:
+        void replyReadyRead();
+        void replyFinished();
+
+        QNetworkReply *reply;
+        QSharedPointer<FlvIndex> index;
+        QByteArray pending;//< Bytes still not a whole tag
+        QByteArray output;//< Bytes waiting to be read
+        qint64 position;//< File position of pending
+        qint64 base;//< Timestamp of the keyframe
+        qint64 span_begin;//< Timestamp the parsing started from
+        qint64 span_end = -1;//< Timestamp of the last tag parsed
+        qint64 received_bytes = 0;
+        bool whole;//< From the begin of the file,keep its header and script tags
+        bool held = false;
+        bool finished = false;
+        bool first_data = true;
+};
+
+PLAYER_NS_END
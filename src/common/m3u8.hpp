@@ -0,0 +1,179 @@
+#pragma once
+
+#include <QNetworkAccessManager>
+#include <QNetworkRequest>
+#include <QNetworkReply>
+#include <QByteArray>
+#include <QIODevice>
+#include <QPointer>
+#include <QHash>
+#include <QList>
+#include <QUrl>
+#include <functional>
+#include <memory>
+
+#include "defs.hpp"
+
+PLAYER_NS_BEGIN
+
+/**
+ * @brief Model of a HLS playlist (media or master)
+ *
+ */
+class M3U8Playlist {
+    public:
+        /**
+         * @brief From #EXT-X-KEY
+         *
+         */
+        struct Key {
+            QByteArray method;//< "NONE" / "AES-128" / "SAMPLE-AES"
+            QUrl uri;
+            QByteArray iv;//< 16 bytes,empty if use the media sequence number
+        };
+        struct Segment {
+            QUrl url;
+            qint64 start;//< Start time in ms
+            qint64 duration;//< Duration in ms
+            qint64 sequence;//< Media sequence number
+            qint64 offset = -1;//< From #EXT-X-BYTERANGE,-1 on the whole file
+            qint64 length = -1;
+            int key = -1;//< Index in keys,-1 on not encrypted
+            bool discontinuity = false;//< Timestamps / Codec changed before it
+        };
+        /**
+         * @brief From #EXT-X-STREAM-INF of a master playlist
+         *
+         */
+        struct Variant {
+            QUrl url;
+            qint64 bandwidth = 0;
+            QByteArray resolution;
+            QByteArray codecs;
+        };
+
+        /**
+         * @brief Parse the playlist in a single pass over the bytes
+         *
+         * @param data The body of the playlist
+         * @param base The url of the playlist,relative uris are resolved against it
+         * @return false on it is not a playlist
+         */
+        bool parse(const QByteArray &data,const QUrl &base);
+
+        bool isMaster() const {
+            return !variants.isEmpty();
+        }
+        /**
+         * @brief Get the variant with the highest bandwidth
+         *
+         * @return -1 on not a master playlist
+         */
+        int bestVariant() const;
+        bool isEncrypted() const;
+
+        QList<Segment> segments;
+        QList<Variant> variants;
+        QList<Key> keys;
+
+        qint64 duration = 0;//< Total duration in ms
+        qint64 target_duration = -1;//< Max segment duration in ms
+        qint64 media_sequence = 0;
+        bool ended = false;//< Has #EXT-X-ENDLIST
+
+        /**
+         * @brief Get the IV of a segment,the explicit one or the media sequence number
+         *        as a 16 bytes big-endian integer
+         *
+         */
+        static QByteArray ivOf(const Key &key,qint64 sequence);
+};
+
+/**
+ * @brief Cache of the AES-128 keys,keyed by the key url
+ *
+ */
+class M3U8KeyCache : public QObject {
+    Q_OBJECT
+    public:
+        /**
+         * @brief Called with the 16 bytes key,or the error string
+         *
+         */
+        using Callback = std::function<void(const QByteArray &key,const QString &error)>;
+
+        static M3U8KeyCache *instance();
+        /**
+         * @brief Get the key,identical lookups in flight share one request
+         *
+         * @param manager
+         * @param request The request of the key
+         * @param context The callback is dropped if it is destroyed
+         * @param callback
+         */
+        void get(QNetworkAccessManager *manager,const QNetworkRequest &request,QObject *context,Callback callback);
+    private:
+        struct Waiter {
+            QPointer<QObject> context;
+            Callback callback;
+        };
+        void replyFinished(QNetworkReply *reply,const QUrl &url);
+
+        QHash<QUrl,QByteArray> keys;
+        QHash<QUrl,QList<Waiter>> pending;
+};
+
+/**
+ * @brief Sequential device of an AES-128 encrypted segment,
+ *        the blocks are decrypted as they arrive from the source
+ *
+ */
+class DecryptStream : public QIODevice {
+    Q_OBJECT
+    public:
+        /**
+         * @brief Construct a new Decrypt Stream object
+         *
+         * @param manager For fetching the key
+         * @param request The request of the segment,the key is fetched with its headers
+         * @param key The url of the key
+         * @param iv 16 bytes
+         * @param source The ciphertext,a sequential one ends by readChannelFinished (taken ownership)
+         * @param parent
+         */
+        DecryptStream(QNetworkAccessManager *manager,const QNetworkRequest &request,const QUrl &key,const QByteArray &iv,QIODevice *source,QObject *parent = nullptr);
+        ~DecryptStream();
+
+        bool isSequential() const override {
+            return true;
+        }
+        bool atEnd() const override {
+            return finished && output.isEmpty();
+        }
+        qint64 bytesAvailable() const override {
+            return output.size() + QIODevice::bytesAvailable();
+        }
+    protected:
+        qint64 readData(char *data,qint64 max) override;
+        qint64 writeData(const char *,qint64) override {
+            return -1;
+        }
+    private:
+        void keyReady(const QByteArray &key,const QString &error);
+        void sourceReadyRead();
+        void sourceFinished();
+        void decrypt(const QByteArray &data);
+        void finish();
+
+        struct Cipher;
+
+        QIODevice *source;
+        std::unique_ptr<Cipher> cipher;//< Null until the key arrived
+        QByteArray iv;
+        QByteArray pending;//< Ciphertext received before the key
+        QByteArray output;//< Plaintext waiting to be read
+        bool source_done = false;
+        bool finished = false;
+};
+
+PLAYER_NS_END
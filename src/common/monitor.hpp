@@ -0,0 +1,106 @@
+#pragma once
+
+#include <QElapsedTimer>
+#include <QObject>
+
+#include "defs.hpp"
+
+//Failover if the buffer is projected to run out in this time (ms)
+#define PLAYER_STARVE_TIME 8000
+//Min time between two starving signals (ms)
+#define PLAYER_STARVE_COOLDOWN 15000
+
+PLAYER_NS_BEGIN
+
+/**
+ * @brief Watch the health of playback,compare the download rate to the play rate
+ *        and record the stalls of a session
+ *
+ */
+class PlaybackMonitor : public QObject {
+    Q_OBJECT
+
+    signals:
+        /**
+         * @brief The buffer is projected to run out soon
+         *
+         * @param segment The segment downloading too slow
+         */
+        void starving(int segment);
+        void stallStarted();
+        void stallEnded(qint64 duration);
+    public:
+        PlaybackMonitor(QObject *parent = nullptr) : QObject(parent){}
+
+        /**
+         * @brief Begin a new session,clear the stats
+         *
+         */
+        void reset();
+        /**
+         * @brief Sample the download feeding the playhead
+         *
+         * @param segment The segment downloading
+         * @param received Bytes of it received by the player
+         * @param bitrate Bytes per ms of the media,0 on unknown
+         * @param ahead Buffered ms ahead
+         * @param playing Is the media playing
+         * @param rate The play rate
+         */
+        void sample(int segment,qint64 received,qreal bitrate,qint64 ahead,bool playing,qreal rate);
+        /**
+         * @brief Nothing is read on purpose (held by the window),
+         *        the next sample starts again
+         *
+         */
+        void skipSample(){
+            sample_timer.invalidate();
+        }
+        /**
+         * @brief The next segment begin downloading / done
+         *
+         */
+        void prefetchStarted(int segment);
+        void prefetchDone(int segment,qint64 duration);
+        /**
+         * @brief Check the prefetching will be done before the current segment end
+         *
+         * @param remaining Ms to the end of current segment
+         */
+        void checkPrefetch(qint64 remaining);
+
+        void stalled();
+        void resumed();
+
+        int stallCount() const {
+            return stall_count;
+        }
+        //Total stall time in ms
+        qint64 stallTime() const;
+        //Media ms downloaded per ms,for the current / prefetched segment
+        qreal downloadRate() const {
+            return download_rate;
+        }
+        qreal prefetchRate() const {
+            return prefetch_rate;
+        }
+    private:
+        void _starving(int segment);
+
+        QElapsedTimer sample_timer;
+        QElapsedTimer prefetch_timer;
+        QElapsedTimer stall_timer;
+        QElapsedTimer starve_timer;//< Since last starving
+
+        qint64 last_received = -1;
+        int last_segment = -1;
+        int prefetch_segment = -1;
+        qreal download_rate = -1;//< Smoothed,-1 on unknown
+        qreal prefetch_rate = -1;
+
+        int stall_count = 0;
+        qint64 stall_time = 0;
+        bool is_stalled = false;
+};
+
+PLAYER_NS_END
@@ -5,14 +5,33 @@
 #include <QtMultimedia/QMediaPlaylist>
 
 #include <QGraphicsTextItem>
+#include <QElapsedTimer>
+#include <QTimer>
 #include <QGraphicsScene>
 #include <QGraphicsView>
 
 #include "defs.hpp"
 #include "app.hpp"
+#include "flv.hpp"
+#include "m3u8.hpp"
+#include "cache.hpp"
+#include "monitor.hpp"
+#include "scheduler.hpp"
 
 //We cached 2 resource at once time
 #define PLAYER_CACHES_SIZE 2
+//Max ms of data we keep ahead of the playhead
+#define PLAYER_BUFFER_WINDOW 60000
+//How often we check the buffer window (ms)
+#define PLAYER_BUFFER_INTERVAL 500
+//Quiet period before a burst of seeks is committed (ms)
+#define PLAYER_SEEK_DELAY 250
+//The clock jumps to the reported position if the drift is larger than it (ms)
+#define PLAYER_CLOCK_SNAP 1500
+//The drift is corrected in this time (ms)
+#define PLAYER_CLOCK_SLEW 1000
+//Bytes downloaded from each mirror to pick the fastest one
+#define PLAYER_FAILOVER_PROBE (256 * 1024)
 
 PLAYER_NS_BEGIN
 
@@ -66,6 +85,51 @@ class DanmakuItem : public QGraphicsTextItem {
         qreal deadtime;
 };
 
+/**
+ * @brief Smooth and monotonic time from the coarse position reported by the backend
+ * 
+ */
+class MediaClock {
+    public:
+        /**
+         * @brief Feed the position reported by the backend,the drift is corrected gently
+         * 
+         * @param reported The position in ms
+         */
+        void update(qint64 reported);
+        /**
+         * @brief Jump to the position (seek or new media),it is allowed to go backwards
+         * 
+         * @param position 
+         */
+        void reset(qint64 position);
+        void setRunning(bool running);
+        void setRate(qreal rate);
+        /**
+         * @brief Get current time in ms
+         * 
+         * @return qint64 
+         */
+        qint64 time() const;
+
+        bool isRunning() const {
+            return running;
+        }
+        qreal rate() const {
+            return play_rate;
+        }
+    private:
+        qint64 _rawTime() const;
+        void   _rebase();
+
+        QElapsedTimer timer;//< Elapsed since base
+        qint64 base = 0;//< Time of the last rebase
+        qreal play_rate = 1.0;
+        qreal correction = 0;//< Extra rate to catch up the drift in PLAYER_CLOCK_SLEW
+        bool running = false;
+        mutable qint64 last = 0;//< Last returned time,keep it monotonic
+};
+
 /**
  * @brief The Interface to play a list of resource like one single resource
  * 
@@ -80,6 +144,13 @@ class MediaPlayer : public QObject {
         void stateChanged(QMediaPlayer::State state);
         void mediaStatusChanged(QMediaPlayer::MediaStatus status);
         void bufferStatusChanged(int percentFilled);
+        /**
+         * @brief How much data is buffered ahead of the playhead
+         * 
+         * @param ahead Buffered ms ahead of the playhead
+         * @param window The window we keep (ms)
+         */
+        void bufferLevelChanged(qint64 ahead,qint64 window);
         void volumeChanged(int volume);
 
         void nativeSizeChanged(const QSizeF &size);
@@ -117,6 +188,32 @@ class MediaPlayer : public QObject {
         }
 
         void _setCurrentPlayer(QMediaPlayer *player);
+        //Load the segment from the SegmentCache,the file if it is downloaded,or a stream of the download
+        //(encrypted ones are decrypted by a DecryptStream)
+        void _loadSegment(QMediaPlayer *player,int segment);
+        void _unloadSegment(QMediaPlayer *player);
+        bool _isStreaming(QMediaPlayer *player) const;
+        void _segmentReady(const QString &key);
+        //Download the segments in the buffer window
+        void _prefetchSegments();
+        //Buffer window
+        void timerEvent(QTimerEvent *event) override;
+        void _updateBuffer();
+        void _beginCaching();
+        void _stopCaching(bool drop = false);//< Pause the next player,or drop its segment
+        void _resetCaching();
+        qint64 _segmentEnd() const;
+        //End time of the segments downloaded from the current one,edge is the first one not done (-1 on none)
+        qint64 _segmentsBuffered(int *edge = nullptr) const;
+        //Flv seeking
+        bool _isFlv() const;
+        void _playFlv(const FlvIndex::Keyframe &key);//< Play by a FlvStream from the keyframe
+        bool _seekFlv(qint64 pos);
+        void _resetFlv();
+        //Failover
+        void _failover(int segment);
+        void _switchMirror(int segment,const QMediaContent &content);
+        void _abortProbes();
         const char *_currentPlayerName(){
             if(&player1 == _currentPlayer())
                 return "player1";
@@ -166,6 +263,52 @@ class MediaPlayer : public QObject {
             player1.setVolume(vol);
             player2.setVolume(vol);
         }
+        /**
+         * @brief Set how many ms of data we keep ahead of the playhead,
+         *        reading from the network is paused when it is full and resumed at the half of it
+         * 
+         * @param ms 
+         */
+        void setBufferWindow(qint64 ms);
+        qint64 bufferWindow() const {
+            return buffer_window;
+        }
+        /**
+         * @brief Get the ms downloaded ahead of the playhead,from the bytes received
+         *        through our streams
+         * 
+         * @return qint64 -1 on unknown (the backend is downloading a url)
+         */
+        qint64 bufferedAhead() const;
+        /**
+         * @brief Set the manager used to do range requests (seeking in flv)
+         * 
+         * @param manager 
+         */
+        void setNetworkManager(QNetworkAccessManager *manager);
+        /**
+         * @brief Drop the loading which may be useless,like caching the next segment
+         *        and the download of the current one,the next setPosition reloads it
+         * 
+         */
+        void cancelLoading();
+        /**
+         * @brief Set the playback rate of players and the clock
+         * 
+         * @param rate 
+         */
+        void setPlaybackRate(qreal rate);
+        /**
+         * @brief Get the smooth clock,danmaku and ui should read time from it
+         * 
+         * @return const MediaClock* 
+         */
+        const MediaClock *mediaClock() const {
+            return &clock;
+        }
+        const PlaybackMonitor *playbackMonitor() const {
+            return &monitor;
+        }
     private:
         //Switch between 2 players
         QMediaPlayer player1;
@@ -174,10 +317,73 @@ class MediaPlayer : public QObject {
         QGraphicsVideoItem *player2_item;
 
         QMediaPlayer *currentPlayer = &player1;
+        MediaClock clock;
+        PlaybackMonitor monitor;
 
-        VideoResource *resource;
+        VideoResource *resource = nullptr;
         QGraphicsVideoItem  empty_item;
         size_t cur_segment = 0;
+
+        //Buffer window
+        qint64 buffer_window = PLAYER_BUFFER_WINDOW;
+        qint64 buffer_ahead = -1;//< Last reported buffer level
+        int buffer_timer = 0;
+        QString held_segment;//< Download held by a full window
+        bool next_caching = false;//< The next player is downloading
+        bool next_cached = false;//< The next player has the next segment
+        bool next_paused = false;//< The next player has the next segment partly,paused by a full window
+
+        //Flv seeking
+        QNetworkAccessManager *manager = nullptr;
+        FlvStream *flv_stream = nullptr;//< Playing from a keyframe
+        qint64 stream_offset = 0;//< Start time of flv_stream
+        qint64 stream_duration = -1;//< Duration of whole video when playing flv_stream
+
+        //Failover
+        QList<QNetworkReply*> probes;//< Racing the mirrors
+        int media_generation = 0;//< Bumped by setMedia,late probes of the old one are dropped
+
+        //Segments
+        QIODevice *segment_streams[2] = {nullptr,nullptr};//< Stream of player1 / player2,null on playing a url / file
+        qint64 stream_seek = -1;//< Seek in the decrypting segment,done once it is downloaded
+        bool loads_canceled = false;//< The download of the current one is aborted by cancelLoading
+};
+
+/**
+ * @brief Coalesce a burst of seeks,only the last target is committed after a quiet period
+ * 
+ */
+class SeekScheduler : public QObject {
+    Q_OBJECT
+
+    signals:
+        void burstStarted();//< The first seek of a burst
+        void targetChanged(qint64 position);//< Emitted at once,for the ui
+        void committed(qint64 position);//< The burst is done,do the real seek
+    public:
+        SeekScheduler(QObject *parent = nullptr);
+
+        /**
+         * @brief Seek to the position,clamped in the media
+         *
+         * @param position
+         * @param duration The duration of the media,-1 on unknown
+         */
+        void request(qint64 position,qint64 duration = -1);
+        void cancel();
+
+        bool isPending() const {
+            return timer.isActive();
+        }
+        qint64 target() const {
+            return pending_target;
+        }
+    private:
+        void commit();
+
+        QTimer timer;
+        qint64 pending_target = 0;
+        int coalesced = 0;//< Requests dropped in this burst
 };
 
 class Player : public QGraphicsView {
@@ -185,6 +391,7 @@ class Player : public QGraphicsView {
 
     signals:
         void error(QMediaPlayer::Error error);
+        void seekTargetChanged(qint64 position);
     public:
         Player(QWidget *parent = nullptr);
         ~Player();
@@ -203,14 +410,19 @@ class Player : public QGraphicsView {
             danmakuPlay();
         }
         void stop();
-        //position in ms
+        //position in ms,the pending target if seeking
         qint64 position() {
+            if(seeker.isPending()){
+                return seeker.target();
+            }
             return mediaPlayer()->position();
         }
+        //The seek is coalesced, see SeekScheduler
         void setPosition(qint64 pos) {
-            danmakuSeek(pos);
-            mediaPlayer()->setPosition(pos);
-            qDeleteAll(danmaku_group->childItems());
+            seeker.request(pos,mediaPlayer()->hasMedia() ? mediaPlayer()->duration() : -1);
+        }
+        bool isSeeking() const {
+            return seeker.isPending();
         }
         //Danmaku variables
         void setDanmakuVisible(bool visible) {
@@ -231,6 +443,7 @@ class Player : public QGraphicsView {
         void durationChanged(qint64 duration);
         void positionChanged(qint64 position);
         void stateChanged(QMediaPlayer::State);
+        void commitSeek(qint64 position);
 
         //Event
         void resizeEvent(QResizeEvent *event) override;
@@ -263,6 +476,7 @@ class Player : public QGraphicsView {
         bool video_ready = false;
 
         MediaPlayer player;
+        SeekScheduler seeker;
 
         int danmaku_timer = 0;
 
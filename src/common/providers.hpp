@@ -3,8 +3,17 @@
 
 #include <QtMultimedia/QMediaContent>
 #include <QtMultimedia/QMediaPlaylist>
+#include <QElapsedTimer>
 
 #include "app.hpp"
+#include "m3u8.hpp"
+
+namespace LXml {
+    class HtmlDocument;
+}
+
+//Master playlists followed before the media playlist
+#define PLAYER_M3U8_DEPTH 2
 
 PLAYER_NS_BEGIN
 
@@ -30,8 +39,43 @@ class TsdmProvider : public VideoProvider {
     public:
         using VideoProvider::VideoProvider;
 
-        bool parseEncrypedM3U8(const QString &m3u8,VideoResource &out);
+        /**
+         * @brief Make the resource from a media playlist
+         * 
+         * @param playlist 
+         * @param out 
+         * @return false on no segment
+         */
+        bool parseEncrypedM3U8(const M3U8Playlist &playlist,VideoResource &out);
         int offset = 113;//< They add a png file before the real video
+        /**
+         * @brief Resolving an unmatched season may ask the user to pick a search result
+         * 
+         */
+        bool canPrefetch() const override {
+            return matched;
+        }
+    protected:
+        /**
+         * @brief Fetch the playlist,a master one is followed to its best variant
+         * 
+         * @param depth Master playlists followed so far,up to PLAYER_M3U8_DEPTH
+         */
+        void fetchM3U8(const QUrl &url,const QByteArray &referer,int depth = 0);
+        void m3u8Ready(QNetworkReply *reply,const QByteArray &referer,int depth);
+        /**
+         * @brief Find the episode pages matched by another window,or in the previous sessions
+         * 
+         * @param season_id 
+         * @param page Set to the detail page if only it is known
+         * @param pages 
+         * @return true if the episode pages are found
+         */
+        bool findMatch(int season_id,QString *page,QMap<int,QString> *pages) const;
+        void saveMatch(int season_id,const QString &page,const QMap<int,QString> &pages);
+        void dropMatch(int season_id);
+
+        bool matched = false;//< The episode pages of the season are known
 };
 class YsjdmProvider : public TsdmProvider {
     public:
@@ -41,13 +85,13 @@ class YsjdmProvider : public TsdmProvider {
         void fetchVideo(const SeasonInfo &season,int idx,QStringView resolution) override;
         void fetchInfo(const SeasonInfo &season,int idx) override;
     private:
-        void videoPagesReady(QNetworkReply *n);
-        void videoPageReady(QNetworkReply *n);
-        void m3u8Ready(QNetworkReply *n);
+        void videoPagesReady(QNetworkReply *n,LXml::HtmlDocument &doc);
+        void videoPageReady(QNetworkReply *n,LXml::HtmlDocument &doc);
 
         void matchVideoPages(const QString &name);
+        void fetchVideoPages(const QString &url);
 
-        bool matched = false;
+        int season_id = -1;//< The season matching for
         QString search_url = "https://www.ysjdm.net/index.php/vod/search.html?wd=%1&submit=";
         QString prefix = "https://www.ysjdm.net";
         QMap<int,QString> video_pages;
@@ -72,10 +116,11 @@ class AngelProvider : public TsdmProvider {
         //Map Bilibili ID to URL
 
         void matchVideoPages(const QString &name);
+        void fetchVideoPages(const QString &url);
         void videoPagesReady(QNetworkReply *n);
         void videoJsReady(QNetworkReply *n,int idx);
 
-        bool matched = false;
+        int season_id = -1;//< The season matching for
         QString video_page ;//< Content of the video page
         QString search_url = "http://tv.66dm.net/search.asp";
         QString url_prefix = "http://tv.66dm.net";
@@ -83,4 +128,58 @@ class AngelProvider : public TsdmProvider {
         QMap<int,QString> video_pages;//< Map Bilibili ID to URL
 };
 
+/**
+ * @brief Compile the XPath expressions of the providers ahead
+ * 
+ */
+void PreloadXPaths();
+/**
+ * @brief Get the evaluation count and time of the XPath expressions
+ * 
+ */
+QString XPathStats();
+
+//Delay between starting two providers in a race (ms)
+#define PLAYER_RACE_HEDGE 1500
+
+/**
+ * @brief Pseudo provider,race the providers and take the first valid video
+ * 
+ */
+class RaceProvider : public VideoProvider {
+    Q_OBJECT
+    public:
+        /**
+         * @brief Construct a new Race Provider object
+         * 
+         * @param m 
+         * @param providers The providers to race,it takes the ownship
+         */
+        RaceProvider(QNetworkAccessManager *m,const QList<VideoProvider*> &providers);
+
+        void fetchVideo(const SeasonInfo &season,int idx,QStringView resolution) override;
+        void fetchInfo(const SeasonInfo &season,int idx) override;
+        void cancelPending() override;
+    private:
+        struct Runner {
+            VideoProvider *provider;
+            QElapsedTimer started;
+            quint64 race = 0;//< The race it running for
+            bool running = false;
+        };
+        void startRunner(int n);
+        void runnerInfoReady(int n,const VideoInfo &info);
+        void runnerVideoReady(int n,const VideoResource &res);
+        void runnerError(int n,const QString &msg);
+        //Stats
+        void record(int n,bool ok);
+        QList<int> order() const;//< Historically fastest first
+
+        QList<Runner> runners;
+        SeasonInfo season;
+        int index = 0;
+        quint64 race = 0;//< Current race,0 on none
+        int failed = 0;
+};
+
 PLAYER_NS_END
\ No newline at end of file
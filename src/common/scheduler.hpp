@@ -0,0 +1,171 @@
+#pragma once
+
+#include <QNetworkAccessManager>
+#include <QNetworkRequest>
+#include <QNetworkReply>
+#include <QSharedPointer>
+#include <QElapsedTimer>
+#include <QPointer>
+#include <QHash>
+#include <QList>
+#include <QMap>
+#include <QUrl>
+#include <functional>
+
+#include "defs.hpp"
+
+//Requests of each class at once
+#define PLAYER_NET_PLAYBACK_LIMIT 6
+#define PLAYER_NET_PREFETCH_LIMIT 4
+#define PLAYER_NET_METADATA_LIMIT 6
+#define PLAYER_NET_BACKGROUND_LIMIT 2
+//Slots (in percent) of the lower classes left while playback requests wait for the first byte
+//(a long running stream does not hold them back),at least one slot is left
+#define PLAYER_NET_PREFETCH_SHARE 25
+#define PLAYER_NET_METADATA_SHARE 50
+#define PLAYER_NET_BACKGROUND_SHARE 0
+//Do not warm a host again in this ms (the idle connections are kept for a while)
+#define PLAYER_WARM_INTERVAL 60000
+//How many video hosts are remembered for warming
+#define PLAYER_WARM_HOSTS 4
+
+PLAYER_NS_BEGIN
+
+/**
+ * @brief Priority classes over the shared manager,playback requests hold back
+ *        and preempt the others
+ *
+ */
+class NetworkScheduler : public QObject {
+    Q_OBJECT
+    signals:
+        /**
+         * @brief A slot is free,for the users keeping their own queue (and call canStart)
+         *
+         */
+        void available();
+    public:
+        enum Class {
+            Playback = 0,//< The data needed for the next frame
+            Prefetch,//< Data ahead of the playhead
+            Metadata,//< Api / pages of the providers
+            Background,//< Danmaku,indexes
+            ClassCount
+        };
+        /**
+         * @brief Called when the request is sent,may be called again with a new reply
+         *        if the previous one is preempted
+         *
+         */
+        using Started = std::function<void(QNetworkReply *reply)>;
+
+        static NetworkScheduler *instance();
+        static const char *nameOf(Class c);
+        /**
+         * @brief Send it now,it is counted in the class
+         *
+         * @param manager
+         * @param request
+         * @param c
+         * @param preemptible Can be aborted by the playback requests,the owner should check isPreempted
+         * @return QNetworkReply*
+         */
+        QNetworkReply *get(QNetworkAccessManager *manager,const QNetworkRequest &request,Class c,bool preemptible = false);
+        QNetworkReply *post(QNetworkAccessManager *manager,const QNetworkRequest &request,const QByteArray &data,Class c);
+        /**
+         * @brief Send it when the class has a free slot,it is sent again if preempted
+         *
+         * @param manager
+         * @param request
+         * @param c
+         * @param context The request is dropped if it is destroyed before sent
+         * @param started
+         */
+        void enqueue(QNetworkAccessManager *manager,const QNetworkRequest &request,Class c,QObject *context,Started started);
+        /**
+         * @brief Move a request in flight to another class,it is no longer preemptible
+         *
+         */
+        void promote(QNetworkReply *reply,Class c);
+        bool canStart(Class c) const {
+            return counts[c] < limitOf(c);
+        }
+        /**
+         * @brief Was the reply aborted for a playback request
+         *
+         */
+        static bool isPreempted(QNetworkReply *reply){
+            return reply->property("preempted").toBool();
+        }
+        /**
+         * @brief Name the stage of the request,the time to first byte is reported by stage
+         *        (the class name if not set)
+         *
+         */
+        static void setStage(QNetworkRequest &request,const QString &stage);
+        /**
+         * @brief Get the readable stats of each class and stage
+         *
+         */
+        QString stats() const;
+    private:
+        struct Job {
+            QPointer<QNetworkAccessManager> manager;
+            QNetworkRequest request;
+            Class cls;
+            QPointer<QObject> context;
+            Started started;
+        };
+        struct Running {
+            Class cls;
+            bool preemptible;
+            QSharedPointer<Job> job;//< Null on sent by get
+            QElapsedTimer timer;//< Since it is sent,invalid after the first byte
+            QString stage;
+        };
+        struct Timing {
+            qint64 count = 0;
+            qint64 total = 0;
+            qint64 max = 0;
+        };
+        int limitOf(Class c) const;
+        QNetworkRequest prepare(const QNetworkRequest &request,Class c) const;
+        void track(QNetworkReply *reply,Class c,bool preemptible,QSharedPointer<Job> job);
+        void untrack(QNetworkReply *reply);
+        void firstByte(QNetworkReply *reply);
+        void setWaiting(const Running &r,int delta);
+        void preempt();
+        void schedule();
+
+        QHash<QNetworkReply*,Running> running;
+        QList<QSharedPointer<Job>> queues[ClassCount];
+        int counts[ClassCount] = {};
+        int waiting = 0;//< Playback requests waiting for the first byte
+        qint64 started[ClassCount] = {};
+        qint64 preempted[ClassCount] = {};
+        QMap<QString,Timing> timings;//< Time to first byte of each stage
+};
+
+/**
+ * @brief Open the connections before the requests,so they do not pay DNS,TCP and TLS in series
+ *
+ */
+class ConnectionWarmer {
+    public:
+        static ConnectionWarmer *instance();
+        /**
+         * @brief Warm the bilibili hosts and the recently used video hosts
+         *
+         */
+        void warm(QNetworkAccessManager *manager);
+        void warmHost(QNetworkAccessManager *manager,const QUrl &origin);
+        /**
+         * @brief Remember the host of a played video,kept in the settings
+         *
+         */
+        void remember(const QUrl &url);
+    private:
+        QHash<QUrl,QElapsedTimer> warmed;
+};
+
+PLAYER_NS_END
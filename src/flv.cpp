@@ -0,0 +1,502 @@
+#include "common/flv.hpp"
+#include "common/scheduler.hpp"
+
+#include <QVariantMap>
+#include <QVariantList>
+#include <QtEndian>
+#include <QDebug>
+#include <algorithm>
+#include <cstring>
+
+PLAYER_NS_BEGIN
+
+namespace {
+
+enum FlvTagType {
+    AudioTag = 8,
+    VideoTag = 9,
+    ScriptTag = 18,
+};
+
+inline quint32 ReadU24(const uchar *p){
+    return (quint32(p[0]) << 16) | (quint32(p[1]) << 8) | quint32(p[2]);
+}
+//Timestamp is 24 bits + 8 bits extended (the upper bits)
+inline qint64 ReadTimestamp(const uchar *p){
+    return qint64(ReadU24(p) | (quint32(p[3]) << 24));
+}
+inline void WriteTimestamp(uchar *p,qint64 ts){
+    p[0] = (ts >> 16) & 0xFF;
+    p[1] = (ts >> 8) & 0xFF;
+    p[2] = ts & 0xFF;
+    p[3] = (ts >> 24) & 0xFF;
+}
+/**
+ * @brief Is the tag a codec sequence header (AVC / AAC config)
+ *
+ */
+inline bool IsSequenceHeader(const uchar *tag,quint32 size){
+    if(size < 2){
+        return false;
+    }
+    const uchar *data = tag + 11;
+    if(tag[0] == VideoTag){
+        //AVC / HEVC packet type 0
+        int codec = data[0] & 0x0F;
+        return (codec == 7 || codec == 12) && data[1] == 0;
+    }
+    if(tag[0] == AudioTag){
+        //AAC packet type 0
+        return (data[0] >> 4) == 10 && data[1] == 0;
+    }
+    return false;
+}
+inline bool IsKeyframe(const uchar *tag,quint32 size){
+    return tag[0] == VideoTag && size > 0 && (tag[11] >> 4) == 1;
+}
+
+/**
+ * @brief Minimal AMF0 reader for onMetaData
+ *
+ */
+class AmfReader {
+    public:
+        AmfReader(const uchar *p,qint64 size) : cur(p), end(p + size) {}
+
+        bool read(QVariant *out,int depth = 0){
+            if(depth > 16 || cur >= end){
+                return false;
+            }
+            uchar type = *cur++;
+            switch(type){
+                case 0x00:{
+                    //Number
+                    double v;
+                    if(!readDouble(&v)){
+                        return false;
+                    }
+                    *out = v;
+                    return true;
+                }
+                case 0x01:{
+                    //Boolean
+                    if(cur >= end){
+                        return false;
+                    }
+                    *out = bool(*cur++);
+                    return true;
+                }
+                case 0x02:
+                case 0x0C:{
+                    //String / Long string
+                    QString s;
+                    if(!readString(&s,type == 0x0C)){
+                        return false;
+                    }
+                    *out = s;
+                    return true;
+                }
+                case 0x08:
+                    //ECMA array,has a count before the properties
+                    if(end - cur < 4){
+                        return false;
+                    }
+                    cur += 4;
+                    Q_FALLTHROUGH();
+                case 0x03:{
+                    //Object
+                    QVariantMap map;
+                    while(true){
+                        if(end - cur >= 3 && cur[0] == 0 && cur[1] == 0 && cur[2] == 0x09){
+                            cur += 3;
+                            break;
+                        }
+                        QString key;
+                        QVariant value;
+                        if(!readString(&key,false) || !read(&value,depth + 1)){
+                            return false;
+                        }
+                        map.insert(key,value);
+                    }
+                    *out = map;
+                    return true;
+                }
+                case 0x0A:{
+                    //Strict array
+                    if(end - cur < 4){
+                        return false;
+                    }
+                    quint32 n = qFromBigEndian<quint32>(cur);
+                    cur += 4;
+                    QVariantList list;
+                    list.reserve(qMin<quint32>(n,(end - cur)));
+                    for(quint32 i = 0;i < n;i++){
+                        QVariant value;
+                        if(!read(&value,depth + 1)){
+                            return false;
+                        }
+                        list.push_back(value);
+                    }
+                    *out = list;
+                    return true;
+                }
+                case 0x0B:{
+                    //Date,double + timezone
+                    double v;
+                    if(!readDouble(&v) || end - cur < 2){
+                        return false;
+                    }
+                    cur += 2;
+                    *out = v;
+                    return true;
+                }
+                case 0x05:
+                case 0x06:
+                    //Null / Undefined
+                    *out = QVariant();
+                    return true;
+                default:
+                    //Unsupported
+                    return false;
+            }
+        }
+        bool readString(QString *out,bool long_str){
+            quint32 len;
+            if(long_str){
+                if(end - cur < 4){
+                    return false;
+                }
+                len = qFromBigEndian<quint32>(cur);
+                cur += 4;
+            }
+            else{
+                if(end - cur < 2){
+                    return false;
+                }
+                len = qFromBigEndian<quint16>(cur);
+                cur += 2;
+            }
+            if(end - cur < qint64(len)){
+                return false;
+            }
+            *out = QString::fromUtf8(reinterpret_cast<const char*>(cur),len);
+            cur += len;
+            return true;
+        }
+    private:
+        bool readDouble(double *out){
+            if(end - cur < 8){
+                return false;
+            }
+            quint64 bits = qFromBigEndian<quint64>(cur);
+            std::memcpy(out,&bits,sizeof(double));
+            cur += 8;
+            return true;
+        }
+
+        const uchar *cur;
+        const uchar *end;
+};
+
+}
+
+//--FlvIndex
+bool FlvIndex::parseHead(const QByteArray &data){
+    auto p = reinterpret_cast<const uchar*>(data.constData());
+    qint64 size = data.size();
+    if(size < 13 || std::memcmp(p,"FLV",3) != 0){
+        return false;
+    }
+    qint64 offset = qFromBigEndian<quint32>(p + 5) + 4;//< Skip header and PreviousTagSize0
+    qint64 head_end = -1;
+    qint64 last = -1;
+
+    while(offset + 11 <= size){
+        const uchar *tag = p + offset;
+        quint32 data_size = ReadU24(tag + 1);
+        qint64 total = 11 + qint64(data_size) + 4;
+        if(offset + total > size){
+            break;
+        }
+        if(tag[0] == ScriptTag){
+            AmfReader reader(tag + 11,data_size);
+            QVariant name;
+            QVariant value;
+            if(reader.read(&name) && name.toString() == "onMetaData" && reader.read(&value)){
+                auto keys = value.toMap().value("keyframes").toMap();
+                auto positions = keys.value("filepositions").toList();
+                auto times = keys.value("times").toList();
+                int n = qMin(positions.size(),times.size());
+                for(int i = 0;i < n;i++){
+                    //Times in seconds
+                    addKeyframe(qint64(times[i].toDouble() * 1000),qint64(positions[i].toDouble()));
+                }
+                complete = n > 0;
+                mplayerDebug() << "Flv onMetaData keyframes" << n;
+            }
+        }
+        else if(head_end < 0 && !IsSequenceHeader(tag,data_size)){
+            //The first media tag,the header is done
+            head_end = offset;
+        }
+        if(IsKeyframe(tag,data_size) && !IsSequenceHeader(tag,data_size)){
+            addKeyframe(ReadTimestamp(tag + 4),offset);
+        }
+        if(tag[0] != ScriptTag){
+            last = qMax(last,ReadTimestamp(tag + 4));
+        }
+        offset += total;
+    }
+    addSpan(0,last);
+    if(head_end < 0){
+        //Head is larger than the data we got
+        return false;
+    }
+    head = data.left(head_end);
+    return true;
+}
+void FlvIndex::addKeyframe(qint64 time,qint64 position){
+    auto iter = std::lower_bound(keyframes.begin(),keyframes.end(),time,[](const Keyframe &k,qint64 t){
+        return k.time < t;
+    });
+    if(iter != keyframes.end() && iter->time == time){
+        //Already in it
+        return;
+    }
+    keyframes.insert(iter,Keyframe{time,position});
+}
+void FlvIndex::addSpan(qint64 begin,qint64 end){
+    if(end < begin){
+        return;
+    }
+    //Merge the overlapped ones into it
+    for(auto iter = spans.begin();iter != spans.end();){
+        if(iter->begin <= end && iter->end >= begin){
+            begin = qMin(begin,iter->begin);
+            end = qMax(end,iter->end);
+            iter = spans.erase(iter);
+        }
+        else{
+            ++iter;
+        }
+    }
+    auto iter = std::lower_bound(spans.begin(),spans.end(),begin,[](const Span &s,qint64 t){
+        return s.begin < t;
+    });
+    spans.insert(iter,Span{begin,end});
+}
+bool FlvIndex::covers(qint64 from,qint64 to) const{
+    if(complete){
+        return true;
+    }
+    for(const auto &span : spans){
+        if(span.begin <= from && to <= span.end){
+            return true;
+        }
+    }
+    return false;
+}
+bool FlvIndex::find(qint64 time,Keyframe *out) const{
+    if(!covers(time)){
+        //The keyframe found may be far before it
+        return false;
+    }
+    auto iter = std::upper_bound(keyframes.begin(),keyframes.end(),time,[](qint64 t,const Keyframe &k){
+        return t < k.time;
+    });
+    if(iter == keyframes.begin()){
+        return false;
+    }
+    --iter;
+    *out = *iter;
+    return true;
+}
+bool FlvIndex::findAfter(qint64 time,Keyframe *out) const{
+    if(!covers(time)){
+        return false;
+    }
+    auto iter = std::lower_bound(keyframes.begin(),keyframes.end(),time,[](const Keyframe &k,qint64 t){
+        return k.time < t;
+    });
+    if(iter == keyframes.end() || !covers(time,iter->time)){
+        //Maybe a nearer one in the gap
+        return false;
+    }
+    *out = *iter;
+    return true;
+}
+
+//--FlvIndexCache
+FlvIndexCache *FlvIndexCache::instance(){
+    static FlvIndexCache cache;
+    return &cache;
+}
+QSharedPointer<FlvIndex> FlvIndexCache::find(const QUrl &url) const{
+    return indexes.value(keyOf(url));
+}
+void FlvIndexCache::alias(const QUrl &url,const QUrl &mirror){
+    auto index = find(url);
+    if(!index.isNull()){
+        indexes.insert(keyOf(mirror),index);
+    }
+}
+void FlvIndexCache::fetch(QNetworkAccessManager *manager,const QNetworkRequest &req){
+    QUrl key = keyOf(req.url());
+    if(indexes.contains(key) || fetching.contains(key)){
+        return;
+    }
+    fetching.insert(key);
+
+    QNetworkRequest request(req);
+    request.setRawHeader("Range","bytes=0-" + QByteArray::number(PLAYER_FLV_HEAD_SIZE - 1));
+    //Only for seeking,wait for the playback
+    NetworkScheduler::instance()->enqueue(manager,request,NetworkScheduler::Background,this,[this,key](QNetworkReply *reply){
+        connect(reply,&QNetworkReply::finished,this,[this,reply,key](){
+            headReady(reply,key);
+        });
+    });
+}
+void FlvIndexCache::headReady(QNetworkReply *reply,const QUrl &key){
+    reply->deleteLater();
+    if(NetworkScheduler::isPreempted(reply)){
+        //Sent again later
+        return;
+    }
+    fetching.remove(key);
+    if(reply->error()){
+        mplayerDebug() << "Flv head fetch failed" << reply->errorString();
+        return;
+    }
+    QSharedPointer<FlvIndex> index(new FlvIndex);
+    if(!index->parseHead(reply->readAll())){
+        mplayerDebug() << "Invalid flv head" << key;
+        return;
+    }
+    indexes.insert(key,index);
+    emit indexReady(key);
+}
+
+//--FlvStream
+FlvStream::FlvStream(QNetworkAccessManager *manager,const QNetworkRequest &req,const FlvIndex::Keyframe &from,QObject *parent):
+    QIODevice(parent),position(from.position),base(from.time),span_begin(from.time),whole(from.position == 0){
+
+    index = FlvIndexCache::instance()->find(req.url());
+    if(!index.isNull() && !whole){
+        output = index->header();
+    }
+
+    QNetworkRequest request(req);
+    if(!whole){
+        request.setRawHeader("Range","bytes=" + QByteArray::number(from.position) + "-");
+    }
+    reply = NetworkScheduler::instance()->get(manager,request,NetworkScheduler::Playback);
+    //Let the socket wait while it is held
+    reply->setReadBufferSize(PLAYER_FLV_READ_BUFFER);
+    connect(reply,&QNetworkReply::readyRead,this,&FlvStream::replyReadyRead);
+    connect(reply,&QNetworkReply::finished,this,&FlvStream::replyFinished);
+
+    open(QIODevice::ReadOnly);
+}
+FlvStream::~FlvStream(){
+    reply->disconnect(this);
+    reply->abort();
+    reply->deleteLater();
+}
+void FlvStream::hold(bool on){
+    if(held == on){
+        return;
+    }
+    held = on;
+    if(!held){
+        //Take what is waiting in the reply
+        replyReadyRead();
+    }
+}
+void FlvStream::abort(){
+    reply->disconnect(this);
+    reply->abort();
+}
+void FlvStream::replyReadyRead(){
+    if(held){
+        return;
+    }
+    auto data = reply->readAll();
+    received_bytes += data.size();
+    pending.append(data);
+    if(first_data && pending.size() >= 13){
+        first_data = false;
+        if(pending.startsWith("FLV")){
+            auto p = reinterpret_cast<const uchar*>(pending.constData());
+            qint64 header_size = qFromBigEndian<quint32>(p + 5) + 4;//< With PreviousTagSize0
+            if(whole){
+                output.append(pending.left(header_size));
+            }
+            else{
+                //The server ignored the Range,we got the whole file,skip the tags before the keyframe
+                mplayerDebug() << "Flv range ignored by server";
+            }
+            pending.remove(0,header_size);
+            position = header_size;
+            span_begin = 0;
+        }
+    }
+    if(first_data){
+        return;
+    }
+
+    qint64 offset = 0;
+    bool got = false;
+    while(pending.size() - offset >= 11){
+        auto tag = reinterpret_cast<uchar*>(pending.data()) + offset;
+        quint32 data_size = ReadU24(tag + 1);
+        qint64 total = 11 + qint64(data_size) + 4;
+        if(pending.size() - offset < total){
+            break;
+        }
+        qint64 ts = ReadTimestamp(tag + 4);
+        if(!index.isNull() && IsKeyframe(tag,data_size) && !IsSequenceHeader(tag,data_size)){
+            //Build the index from the downloaded tags
+            index->addKeyframe(ts,position + offset);
+        }
+        if(tag[0] != ScriptTag){
+            span_end = qMax(span_end,ts);
+        }
+        if(ts >= base && (whole || tag[0] != ScriptTag)){
+            WriteTimestamp(tag + 4,ts - base);
+            output.append(reinterpret_cast<const char*>(tag),total);
+            got = true;
+        }
+        offset += total;
+    }
+    pending.remove(0,offset);
+    position += offset;
+    if(!index.isNull()){
+        //The tags are read one by one from the keyframe,no keyframe is missed
+        index->addSpan(span_begin,span_end);
+    }
+
+    if(got){
+        emit readyRead();
+    }
+}
+void FlvStream::replyFinished(){
+    if(reply->error() && reply->error() != QNetworkReply::OperationCanceledError){
+        mplayerDebug() << "Flv stream error" << reply->errorString();
+    }
+    //The rest is in the read buffer,take it even if held
+    held = false;
+    replyReadyRead();
+    finished = true;
+    emit readChannelFinished();
+}
+qint64 FlvStream::readData(char *data,qint64 max){
+    if(output.isEmpty()){
+        return finished ? -1 : 0;
+    }
+    qint64 n = qMin<qint64>(max,output.size());
+    std::memcpy(data,output.constData(),n);
+    output.remove(0,n);
+    return n;
+}
+
+PLAYER_NS_END
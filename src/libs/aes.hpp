@@ -0,0 +1,443 @@
+#pragma once
+
+//--AES-128 decryption for HLS (#EXT-X-KEY:METHOD=AES-128)
+//  Software T-table implementation,AES-NI when the cpu supports it
+
+#ifndef AES_NAMESPACE
+    #define AES_NAMESPACE Aes
+#endif
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+    #define AES_HAS_NI 1
+#else
+    #define AES_HAS_NI 0
+#endif
+
+#if AES_HAS_NI
+    #if defined(_MSC_VER) && !defined(__clang__)
+        #include <intrin.h>
+        #define AES_NI_TARGET
+    #else
+        #include <cpuid.h>
+        #define AES_NI_TARGET __attribute__((target("aes,sse2")))
+    #endif
+    #include <wmmintrin.h>
+    #include <emmintrin.h>
+#endif
+
+//--Import std headers
+#include <cstdint>
+#include <cstring>
+#include <cstddef>
+
+namespace AES_NAMESPACE {
+
+constexpr size_t BlockSize = 16;
+constexpr size_t KeySize = 16;
+constexpr int    Rounds = 10;
+
+namespace Impl {
+
+/**
+ * @brief S-box and the decryption tables,built once
+ *
+ */
+struct Tables {
+    uint8_t  sbox[256];
+    uint8_t  inv_sbox[256];
+    uint32_t td[4][256];
+
+    Tables() {
+        //Build the S-box from the multiplicative inverse in GF(2^8)
+        uint8_t p = 1,q = 1;
+        do{
+            //p * 3
+            p = p ^ uint8_t(p << 1) ^ ((p & 0x80) ? 0x1B : 0);
+            //q / 3
+            q ^= q << 1;
+            q ^= q << 2;
+            q ^= q << 4;
+            if(q & 0x80){
+                q ^= 0x09;
+            }
+            uint8_t x = q ^ Rotl8(q,1) ^ Rotl8(q,2) ^ Rotl8(q,3) ^ Rotl8(q,4);
+            sbox[p] = x ^ 0x63;
+        }
+        while(p != 1);
+        sbox[0] = 0x63;
+
+        for(int i = 0;i < 256;i++){
+            inv_sbox[sbox[i]] = uint8_t(i);
+        }
+        for(int i = 0;i < 256;i++){
+            uint8_t s = inv_sbox[i];
+            uint32_t w = (uint32_t(Mul(s,0x0E)) << 24) |
+                         (uint32_t(Mul(s,0x09)) << 16) |
+                         (uint32_t(Mul(s,0x0D)) << 8)  |
+                          uint32_t(Mul(s,0x0B));
+            td[0][i] = w;
+            td[1][i] = Rotr32(w,8);
+            td[2][i] = Rotr32(w,16);
+            td[3][i] = Rotr32(w,24);
+        }
+    }
+
+    static uint8_t Rotl8(uint8_t x,int n) {
+        return uint8_t((x << n) | (x >> (8 - n)));
+    }
+    static uint32_t Rotr32(uint32_t x,int n) {
+        return (x >> n) | (x << (32 - n));
+    }
+    static uint8_t Mul(uint8_t a,uint8_t b) {
+        uint8_t r = 0;
+        while(b){
+            if(b & 1){
+                r ^= a;
+            }
+            a = uint8_t(a << 1) ^ ((a & 0x80) ? 0x1B : 0);
+            b >>= 1;
+        }
+        return r;
+    }
+
+    static const Tables &Instance() {
+        static Tables tables;
+        return tables;
+    }
+};
+
+inline uint32_t LoadBE(const uint8_t *p) {
+    return (uint32_t(p[0]) << 24) | (uint32_t(p[1]) << 16) | (uint32_t(p[2]) << 8) | uint32_t(p[3]);
+}
+inline void StoreBE(uint8_t *p,uint32_t v) {
+    p[0] = uint8_t(v >> 24);
+    p[1] = uint8_t(v >> 16);
+    p[2] = uint8_t(v >> 8);
+    p[3] = uint8_t(v);
+}
+
+#if AES_HAS_NI
+inline bool DetectNI() {
+    #if defined(_MSC_VER) && !defined(__clang__)
+        int info[4];
+        __cpuid(info,1);
+        return (info[2] & (1 << 25)) != 0;
+    #else
+        unsigned int a,b,c,d;
+        if(!__get_cpuid(1,&a,&b,&c,&d)){
+            return false;
+        }
+        return (c & bit_AES) != 0;
+    #endif
+}
+#endif
+
+}
+
+/**
+ * @brief Does the cpu have AES-NI,checked once
+ *
+ */
+inline bool HasNI() {
+#if AES_HAS_NI
+    static const bool has = Impl::DetectNI();
+    return has;
+#else
+    return false;
+#endif
+}
+
+/**
+ * @brief AES-128 block decryption,pick the AES-NI path when it is available
+ *
+ */
+class Decryptor {
+    public:
+        Decryptor() = default;
+        Decryptor(const uint8_t *key,bool allow_ni = true) {
+            set_key(key,allow_ni);
+        }
+
+        /**
+         * @brief Expand the key
+         *
+         * @param key 16 bytes
+         * @param allow_ni false to force the software path (for testing)
+         */
+        void set_key(const uint8_t *key,bool allow_ni = true) {
+            const auto &t = Impl::Tables::Instance();
+            //Encryption schedule
+            uint32_t ek[4 * (Rounds + 1)];
+            for(int i = 0;i < 4;i++){
+                ek[i] = Impl::LoadBE(key + 4 * i);
+            }
+            uint8_t rcon = 1;
+            for(int i = 4;i < 4 * (Rounds + 1);i++){
+                uint32_t w = ek[i - 1];
+                if(i % 4 == 0){
+                    w = (uint32_t(t.sbox[(w >> 16) & 0xFF]) << 24) |
+                        (uint32_t(t.sbox[(w >> 8) & 0xFF]) << 16)  |
+                        (uint32_t(t.sbox[w & 0xFF]) << 8)          |
+                         uint32_t(t.sbox[w >> 24]);
+                    w ^= uint32_t(rcon) << 24;
+                    rcon = Impl::Tables::Mul(rcon,2);
+                }
+                ek[i] = ek[i - 4] ^ w;
+            }
+            //Equivalent inverse cipher,reverse the rounds and InvMixColumns the middle ones
+            for(int r = 0;r <= Rounds;r++){
+                for(int i = 0;i < 4;i++){
+                    uint32_t w = ek[4 * (Rounds - r) + i];
+                    if(r != 0 && r != Rounds){
+                        w = t.td[0][t.sbox[w >> 24]] ^
+                            t.td[1][t.sbox[(w >> 16) & 0xFF]] ^
+                            t.td[2][t.sbox[(w >> 8) & 0xFF]] ^
+                            t.td[3][t.sbox[w & 0xFF]];
+                    }
+                    dk[4 * r + i] = w;
+                }
+            }
+            use_ni = allow_ni && HasNI();
+#if AES_HAS_NI
+            if(use_ni){
+                for(int r = 0;r <= Rounds;r++){
+                    uint8_t bytes[16];
+                    for(int i = 0;i < 4;i++){
+                        Impl::StoreBE(bytes + 4 * i,dk[4 * r + i]);
+                    }
+                    std::memcpy(ni_keys + 16 * r,bytes,16);
+                }
+            }
+#endif
+        }
+        bool is_ni() const {
+            return use_ni;
+        }
+        /**
+         * @brief Decrypt blocks in CBC mode
+         *
+         * @param in Ciphertext,n * 16 bytes
+         * @param out Plaintext,may be the same as in
+         * @param n Number of blocks
+         * @param iv 16 bytes,updated to the last ciphertext block
+         */
+        void decrypt_cbc(const uint8_t *in,uint8_t *out,size_t n,uint8_t *iv) const {
+#if AES_HAS_NI
+            if(use_ni){
+                DecryptCbcNI(ni_keys,in,out,n,iv);
+                return;
+            }
+#endif
+            uint8_t prev[BlockSize];
+            uint8_t cur[BlockSize];
+            std::memcpy(prev,iv,BlockSize);
+            for(size_t i = 0;i < n;i++){
+                std::memcpy(cur,in + i * BlockSize,BlockSize);
+                decrypt_block(cur,out + i * BlockSize);
+                for(size_t k = 0;k < BlockSize;k++){
+                    out[i * BlockSize + k] ^= prev[k];
+                }
+                std::memcpy(prev,cur,BlockSize);
+            }
+            std::memcpy(iv,prev,BlockSize);
+        }
+        /**
+         * @brief Decrypt a single block by the software path
+         *
+         */
+        void decrypt_block(const uint8_t *in,uint8_t *out) const {
+            const auto &t = Impl::Tables::Instance();
+            const uint32_t *k = dk;
+            uint32_t s0 = Impl::LoadBE(in)      ^ k[0];
+            uint32_t s1 = Impl::LoadBE(in + 4)  ^ k[1];
+            uint32_t s2 = Impl::LoadBE(in + 8)  ^ k[2];
+            uint32_t s3 = Impl::LoadBE(in + 12) ^ k[3];
+            uint32_t t0,t1,t2,t3;
+            for(int r = 1;r < Rounds;r++){
+                k += 4;
+                t0 = t.td[0][s0 >> 24] ^ t.td[1][(s3 >> 16) & 0xFF] ^ t.td[2][(s2 >> 8) & 0xFF] ^ t.td[3][s1 & 0xFF] ^ k[0];
+                t1 = t.td[0][s1 >> 24] ^ t.td[1][(s0 >> 16) & 0xFF] ^ t.td[2][(s3 >> 8) & 0xFF] ^ t.td[3][s2 & 0xFF] ^ k[1];
+                t2 = t.td[0][s2 >> 24] ^ t.td[1][(s1 >> 16) & 0xFF] ^ t.td[2][(s0 >> 8) & 0xFF] ^ t.td[3][s3 & 0xFF] ^ k[2];
+                t3 = t.td[0][s3 >> 24] ^ t.td[1][(s2 >> 16) & 0xFF] ^ t.td[2][(s1 >> 8) & 0xFF] ^ t.td[3][s0 & 0xFF] ^ k[3];
+                s0 = t0;
+                s1 = t1;
+                s2 = t2;
+                s3 = t3;
+            }
+            k += 4;
+            const uint8_t *is = t.inv_sbox;
+            t0 = (uint32_t(is[s0 >> 24]) << 24) | (uint32_t(is[(s3 >> 16) & 0xFF]) << 16) | (uint32_t(is[(s2 >> 8) & 0xFF]) << 8) | is[s1 & 0xFF];
+            t1 = (uint32_t(is[s1 >> 24]) << 24) | (uint32_t(is[(s0 >> 16) & 0xFF]) << 16) | (uint32_t(is[(s3 >> 8) & 0xFF]) << 8) | is[s2 & 0xFF];
+            t2 = (uint32_t(is[s2 >> 24]) << 24) | (uint32_t(is[(s1 >> 16) & 0xFF]) << 16) | (uint32_t(is[(s0 >> 8) & 0xFF]) << 8) | is[s3 & 0xFF];
+            t3 = (uint32_t(is[s3 >> 24]) << 24) | (uint32_t(is[(s2 >> 16) & 0xFF]) << 16) | (uint32_t(is[(s1 >> 8) & 0xFF]) << 8) | is[s0 & 0xFF];
+            Impl::StoreBE(out,      t0 ^ k[0]);
+            Impl::StoreBE(out + 4,  t1 ^ k[1]);
+            Impl::StoreBE(out + 8,  t2 ^ k[2]);
+            Impl::StoreBE(out + 12, t3 ^ k[3]);
+        }
+    private:
+#if AES_HAS_NI
+        AES_NI_TARGET
+        static void DecryptCbcNI(const uint8_t *keys,const uint8_t *in,uint8_t *out,size_t n,uint8_t *iv) {
+            __m128i k[Rounds + 1];
+            for(int r = 0;r <= Rounds;r++){
+                k[r] = _mm_loadu_si128(reinterpret_cast<const __m128i*>(keys + 16 * r));
+            }
+            __m128i prev = _mm_loadu_si128(reinterpret_cast<const __m128i*>(iv));
+            size_t i = 0;
+            //CBC decryption has no chain,keep 4 blocks in the pipeline
+            for(;i + 4 <= n;i += 4){
+                auto src = reinterpret_cast<const __m128i*>(in + i * BlockSize);
+                __m128i c0 = _mm_loadu_si128(src);
+                __m128i c1 = _mm_loadu_si128(src + 1);
+                __m128i c2 = _mm_loadu_si128(src + 2);
+                __m128i c3 = _mm_loadu_si128(src + 3);
+                __m128i b0 = _mm_xor_si128(c0,k[0]);
+                __m128i b1 = _mm_xor_si128(c1,k[0]);
+                __m128i b2 = _mm_xor_si128(c2,k[0]);
+                __m128i b3 = _mm_xor_si128(c3,k[0]);
+                for(int r = 1;r < Rounds;r++){
+                    b0 = _mm_aesdec_si128(b0,k[r]);
+                    b1 = _mm_aesdec_si128(b1,k[r]);
+                    b2 = _mm_aesdec_si128(b2,k[r]);
+                    b3 = _mm_aesdec_si128(b3,k[r]);
+                }
+                b0 = _mm_xor_si128(_mm_aesdeclast_si128(b0,k[Rounds]),prev);
+                b1 = _mm_xor_si128(_mm_aesdeclast_si128(b1,k[Rounds]),c0);
+                b2 = _mm_xor_si128(_mm_aesdeclast_si128(b2,k[Rounds]),c1);
+                b3 = _mm_xor_si128(_mm_aesdeclast_si128(b3,k[Rounds]),c2);
+                prev = c3;
+                auto dst = reinterpret_cast<__m128i*>(out + i * BlockSize);
+                _mm_storeu_si128(dst,b0);
+                _mm_storeu_si128(dst + 1,b1);
+                _mm_storeu_si128(dst + 2,b2);
+                _mm_storeu_si128(dst + 3,b3);
+            }
+            for(;i < n;i++){
+                __m128i c = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i * BlockSize));
+                __m128i b = _mm_xor_si128(c,k[0]);
+                for(int r = 1;r < Rounds;r++){
+                    b = _mm_aesdec_si128(b,k[r]);
+                }
+                b = _mm_xor_si128(_mm_aesdeclast_si128(b,k[Rounds]),prev);
+                prev = c;
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i * BlockSize),b);
+            }
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(iv),prev);
+        }
+
+        uint8_t  ni_keys[16 * (Rounds + 1)];//< Decryption round keys in bytes
+#endif
+        uint32_t dk[4 * (Rounds + 1)];//< Decryption round keys
+        bool     use_ni = false;
+};
+
+/**
+ * @brief Streaming CBC decryption,the data can be fed in any size,
+ *        the last block is held back until finish() to strip the PKCS7 padding
+ *
+ */
+class CbcStream {
+    public:
+        CbcStream() = default;
+        CbcStream(const uint8_t *key,const uint8_t *iv) {
+            reset(key,iv);
+        }
+
+        void reset(const uint8_t *key,const uint8_t *iv) {
+            aes.set_key(key);
+            std::memcpy(chain,iv,BlockSize);
+            partial_size = 0;
+            held = false;
+        }
+        /**
+         * @brief Decrypt the data
+         *
+         * @param in
+         * @param size
+         * @param out The plaintext,must have size + 16 bytes at least
+         * @return The bytes written to out
+         */
+        size_t update(const uint8_t *in,size_t size,uint8_t *out) {
+            size_t written = 0;
+            if(size == 0){
+                return 0;
+            }
+            //Release the held block,more data is coming
+            if(held){
+                std::memcpy(out,last,BlockSize);
+                written += BlockSize;
+                held = false;
+            }
+            //Fill the partial block first
+            if(partial_size > 0){
+                size_t n = BlockSize - partial_size;
+                if(n > size){
+                    n = size;
+                }
+                std::memcpy(partial + partial_size,in,n);
+                partial_size += n;
+                in += n;
+                size -= n;
+                if(partial_size < BlockSize){
+                    return written;
+                }
+                aes.decrypt_cbc(partial,out + written,1,chain);
+                written += BlockSize;
+                partial_size = 0;
+            }
+            size_t blocks = size / BlockSize;
+            if(blocks > 0){
+                aes.decrypt_cbc(in,out + written,blocks,chain);
+                written += blocks * BlockSize;
+                in += blocks * BlockSize;
+                size -= blocks * BlockSize;
+            }
+            //Keep the tail for the next call
+            std::memcpy(partial,in,size);
+            partial_size = size;
+
+            //Hold the last block back,it may be the padding
+            if(partial_size == 0 && written >= BlockSize){
+                written -= BlockSize;
+                std::memcpy(last,out + written,BlockSize);
+                held = true;
+            }
+            return written;
+        }
+        /**
+         * @brief End of the stream,strip the padding
+         *
+         * @param out At least 16 bytes
+         * @return The bytes written to out,or -1 on the data is not padded
+         */
+        long finish(uint8_t *out) {
+            if(partial_size != 0 || !held){
+                return -1;
+            }
+            held = false;
+            uint8_t pad = last[BlockSize - 1];
+            if(pad == 0 || pad > BlockSize){
+                return -1;
+            }
+            for(size_t i = BlockSize - pad;i < BlockSize;i++){
+                if(last[i] != pad){
+                    return -1;
+                }
+            }
+            std::memcpy(out,last,BlockSize - pad);
+            return long(BlockSize - pad);
+        }
+        bool is_ni() const {
+            return aes.is_ni();
+        }
+    private:
+        Decryptor aes;
+        uint8_t   chain[BlockSize];//< The previous ciphertext block
+        uint8_t   partial[BlockSize];//< Ciphertext not a whole block
+        uint8_t   last[BlockSize];//< Plaintext held back
+        size_t    partial_size = 0;
+        bool      held = false;
+};
+
+}
@@ -61,17 +61,28 @@
 //--Import libxml2 headers
 #include <libxml/HTMLparser.h>
 #include <libxml/HTMLtree.h>
+#include <libxml/SAX2.h>
 #include <libxml/xmlversion.h>
 #include <libxml/xpath.h>
 #include <libxml/tree.h>
 //--Import std headers
+#include <unordered_map>
 #include <type_traits>
+#include <cstdint>
+#include <memory>
+#include <atomic>
+#include <chrono>
+#include <vector>
+#include <mutex>
+
+//--Import Qt adaptors
+#ifdef LXML_QT
+    #include <QLatin1String>
+    #include <QString>
+#endif
 
 //--Detail of progress
-//--TODO : Add a special class to manage mem return by libxml2,avoid useless copy
-//         Such as LXml::lstring or LXml::string or LXml::ustring
 //--TODO : Add SAXParser
-//--TODO : Add PushParser
 
 
 
@@ -118,6 +129,89 @@ inline u8string ToString(const xmlChar *s) {
     u8string us(reinterpret_cast<const char_t *>(s));
     return us;
 }
+/**
+ * @brief String allocated by libxml2,freed by xmlFree,no copy on getting it
+ * 
+ */
+class lstring {
+    public:
+        lstring() = default;
+        lstring(const lstring &) = delete;
+        lstring(lstring && other) noexcept : str(other.str) {
+            other.str = nullptr;
+        }
+        ~lstring() {
+            xmlFree(str);
+        }
+        //--Take the ownship
+        explicit lstring(xmlChar *s) : str(s) {}
+
+        lstring &operator =(lstring && other) noexcept {
+            if(this != &other){
+                xmlFree(str);
+                str = other.str;
+                other.str = nullptr;
+            }
+            return *this;
+        }
+
+        bool empty() const noexcept {
+            return str == nullptr || *str == '\0';
+        }
+        bool is_null() const noexcept {
+            return str == nullptr;
+        }
+        size_t size() const noexcept {
+            return str == nullptr ? 0 : size_t(xmlStrlen(str));
+        }
+        const char_t *c_str() const noexcept {
+            return str == nullptr ? "" : reinterpret_cast<const char_t *>(str);
+        }
+        const char_t *data() const noexcept {
+            return c_str();
+        }
+        u8string to_string() const {
+            return u8string(c_str(),size());
+        }
+#if LXML_CXX17
+        std::string_view view() const noexcept {
+            return std::string_view(c_str(),size());
+        }
+        operator std::string_view() const noexcept {
+            return view();
+        }
+#endif
+#ifdef LXML_QT
+        QString to_qstring() const {
+            return QString::fromUtf8(c_str(),int(size()));
+        }
+#endif
+        /**
+         * @brief Release the ownship
+         * 
+         */
+        xmlChar *detach() noexcept {
+            auto s = str;
+            str = nullptr;
+            return s;
+        }
+    private:
+        xmlChar *str = nullptr;
+};
+#ifdef LXML_QT
+//--Qt adaptors,for the views of the document
+inline QString ToQString(const xmlChar *s) {
+    return QString::fromUtf8(reinterpret_cast<const char *>(s));
+}
+#if LXML_CXX17
+inline QString ToQString(std::string_view v) {
+    return QString::fromUtf8(v.data(),int(v.size()));
+}
+inline QLatin1String ToLatin1(std::string_view v) {
+    return QLatin1String(v.data(),int(v.size()));
+}
+#endif
+#endif
 /**
  * @brief Reference to a document
  * 
@@ -317,6 +411,9 @@ class NodeRef {
         u8string content() const {
             return ToString(xmlNodeGetContent(node));
         }
+        lstring content_lstring() const {
+            return lstring(xmlNodeGetContent(node));
+        }
         void set_content(u8string_view s) {
             xmlNodeSetContentLen(node,BAD_CAST s.data(),s.size());
         }
@@ -334,6 +431,36 @@ class NodeRef {
         u8string attribute(u8string_view name) const {
             return ToString(xmlGetProp(node,BAD_CAST name.data()));
         }
+        lstring attribute_lstring(u8string_view name) const {
+            return lstring(xmlGetProp(node,BAD_CAST name.data()));
+        }
+#if LXML_CXX17
+        /**
+         * @brief View the attribute value in the document,no allocation
+         * 
+         * @param name Zero terminated string
+         * @return Empty if not found or the value has entities (use attribute_lstring)
+         */
+        std::string_view attribute_view(std::string_view name) const {
+            for(xmlAttrPtr attr = node->properties;attr != nullptr;attr = attr->next){
+                if(xmlStrEqual(attr->name,BAD_CAST name.data())){
+                    return TextView(attr->children);
+                }
+            }
+            return std::string_view();
+        }
+        /**
+         * @brief View the content of a text node,or an element with a single text child,no allocation
+         * 
+         * @return Empty on other nodes (use content_lstring)
+         */
+        std::string_view content_view() const {
+            if(node->type == XML_TEXT_NODE || node->type == XML_CDATA_SECTION_NODE){
+                return TextView(node);
+            }
+            return TextView(node->children);
+        }
+#endif
         void set_attribute(u8string_view name,u8string_view value) {
             xmlSetProp(node,BAD_CAST name.data(),BAD_CAST value.data());
         }
@@ -370,11 +497,25 @@ class NodeRef {
         }
         //--Find Node
         XPathObject xpath(u8string_view s) const;
+        XPathObject xpath(const XPathExpression &expr) const;
         //--Create element as child
         NodeRef create_element(u8string_view name) const;        
 
         Node clone() const;
     private:
+#if LXML_CXX17
+        //View of a single text node
+        static std::string_view TextView(xmlNodePtr text) {
+            if(text == nullptr || text->next != nullptr || text->content == nullptr){
+                return std::string_view();
+            }
+            //Script / Style are cdata in html
+            if(text->type != XML_TEXT_NODE && text->type != XML_CDATA_SECTION_NODE){
+                return std::string_view();
+            }
+            return std::string_view(reinterpret_cast<const char *>(text->content));
+        }
+#endif
         xmlNodePtr node = nullptr;
     friend class Node;
 };
@@ -440,6 +581,9 @@ class HtmlDocument : public Document {
         using Document::Document;
         //--Parse a document from a string
         static HtmlDocument Parse(u8string_view str,int opt = DefaultOptions);
+        //--Parse a document from raw bytes in the encoding,decoded once by libxml2
+        //--nullptr encoding to detect it from the document
+        static HtmlDocument Parse(const char *data,size_t size,const char *encoding,int opt = DefaultOptions);
         static HtmlDocument New(const char *url = nullptr,const char *ext_id = nullptr);
 };
 
@@ -479,6 +623,15 @@ inline HtmlDocument HtmlDocument::Parse(u8string_view str,int opt) {
 #endif
     return HtmlDocument(doc);
 }
+inline HtmlDocument HtmlDocument::Parse(const char *data,size_t size,const char *encoding,int opt) {
+    xmlDocPtr doc = htmlReadMemory(data,int(size),"",encoding,opt);
+#ifndef LXML_NO_EXCEPTIONS
+    if(doc == nullptr){
+        LXML_THROW(std::runtime_error("Failed to parse html document"));
+    }
+#endif
+    return HtmlDocument(doc);
+}
 inline HtmlDocument HtmlDocument::New(const char *url,const char *ext_id) {
     return HtmlDocument(htmlNewDoc(BAD_CAST url,BAD_CAST ext_id));
 }
@@ -717,7 +870,7 @@ class XPathContent {
                 )
             );
         }
-        // XPathObject eval(const XPathExpression &) const;
+        XPathObject eval(const XPathExpression &expr) const;
         /**
          * @brief Eval on node you gived,not on the root node of the document
          * 
@@ -733,7 +886,7 @@ class XPathContent {
                 )
             );
         }
-        // XPathObject eval(NodeRef node,const XPathExpression &) const;
+        XPathObject eval(NodeRef node,const XPathExpression &expr) const;
 
         //Assign
         void assign(XPathContent &&other){
@@ -758,23 +911,259 @@ class XPathContent {
  */
 class XPathExpression {
     public:
-        XPathExpression();
+        XPathExpression() = default;
         XPathExpression(const XPathExpression &) = delete;
-        XPathExpression(XPathExpression &&);
+        XPathExpression(XPathExpression && other) {
+            expr = other.expr;
+            other.expr = nullptr;
+        }
         ~XPathExpression() {
             xmlXPathFreeCompExpr(expr);
         }
 
         explicit XPathExpression(xmlXPathCompExprPtr p) : expr(p) {}
+
+        XPathExpression &operator =(XPathExpression &&other) {
+            if(this != &other){
+                xmlXPathFreeCompExpr(expr);
+                expr = other.expr;
+                other.expr = nullptr;
+            }
+            return *this;
+        }
+
+        /**
+         * @brief Compile a expression without context
+         * 
+         * @param s Zero terminated string
+         * @return XPathExpression 
+         */
+        static XPathExpression Compile(u8string_view s) {
+            return XPathExpression(xmlXPathCompile(BAD_CAST s.data()));
+        }
+
+        bool is_null() const noexcept {
+            return expr == nullptr;
+        }
+        xmlXPathCompExprPtr get() const noexcept {
+            return expr;
+        }
     private:
         xmlXPathCompExprPtr expr = nullptr;
 };
 
+//--Impl for XPathContent
+inline XPathExpression XPathContent::compile(u8string_view s) {
+    return XPathExpression(xmlXPathCtxtCompile(ctxt,BAD_CAST s.data()));
+}
+inline XPathObject XPathContent::eval(const XPathExpression &expr) const {
+    return XPathObject(xmlXPathCompiledEval(expr.get(),ctxt));
+}
+inline XPathObject XPathContent::eval(NodeRef node,const XPathExpression &expr) const {
+    ctxt->node = node.get();
+    return XPathObject(xmlXPathCompiledEval(expr.get(),ctxt));
+}
+
 //--Impl for find operations for NodeRef
 
-XPathObject NodeRef::xpath(u8string_view s) const {
+inline XPathObject NodeRef::xpath(u8string_view s) const {
     XPathContent ctxt(document());
     return ctxt.eval(*this,s);
 }
+inline XPathObject NodeRef::xpath(const XPathExpression &expr) const {
+    XPathContent ctxt(document());
+    return ctxt.eval(*this,expr);
+}
+
+/**
+ * @brief Process-wide table of compiled expressions,each one is compiled once
+ *        and counts the evaluations and the time spent on it
+ * 
+ */
+class XPathRegistry {
+    public:
+        struct Stat {
+            const char *source;
+            uint64_t    count;
+            uint64_t    nanoseconds;
+        };
+
+        static XPathRegistry &Instance() {
+            static XPathRegistry registry;
+            return registry;
+        }
+        /**
+         * @brief Compile the expressions ahead
+         * 
+         * @param list Zero terminated strings
+         */
+        void preload(std::initializer_list<const char *> list) {
+            for(auto s : list){
+                find(s);
+            }
+        }
+        /**
+         * @brief Eval the expression on the node
+         * 
+         * @param node 
+         * @param s Zero terminated string,compiled on the first use
+         * @return XPathObject (null on invalid expression)
+         */
+        XPathObject eval(NodeRef node,const char *s) {
+            auto &entry = find(s);
+            if(entry.expr.is_null() || node.is_null()){
+                return XPathObject(nullptr);
+            }
+            auto begin = std::chrono::steady_clock::now();
+            auto obj = node.xpath(entry.expr);
+            auto end = std::chrono::steady_clock::now();
+
+            entry.count += 1;
+            entry.nanoseconds += std::chrono::duration_cast<std::chrono::nanoseconds>(end - begin).count();
+            return obj;
+        }
+        std::vector<Stat> stats() const {
+            std::lock_guard<std::mutex> locker(mutex);
+            std::vector<Stat> vec;
+            for(auto &pair : entries){
+                vec.push_back(Stat{pair.second->source.c_str(),pair.second->count,pair.second->nanoseconds});
+            }
+            return vec;
+        }
+    private:
+        struct Entry {
+            u8string              source;
+            XPathExpression       expr;
+            std::atomic<uint64_t> count {0};
+            std::atomic<uint64_t> nanoseconds {0};
+        };
+        Entry &find(const char *s) {
+            std::lock_guard<std::mutex> locker(mutex);
+            auto &entry = entries[s];
+            if(entry == nullptr){
+                entry.reset(new Entry);
+                entry->source = s;
+                entry->expr = XPathExpression::Compile(s);
+            }
+            return *entry;
+        }
+
+        mutable std::mutex mutex;
+        std::unordered_map<u8string,std::unique_ptr<Entry>> entries;
+};
+
+LXML_NS_END
+
+//--PushParser
+LXML_NS_BEGIN
+/**
+ * @brief Html parser fed chunk by chunk,the document is built while the data arrives
+ * 
+ */
+class PushParser {
+    public:
+        /**
+         * @brief Construct a new Push Parser object
+         * 
+         * @param encoding The encoding of the data,nullptr to detect it from the document
+         * @param opt 
+         */
+        PushParser(const char *encoding = nullptr,int opt = DefaultOptions) {
+            //The default handler builds the tree,we only look at the closed elements
+            htmlSAXHandler sax = {};
+            xmlSAX2InitHtmlDefaultSAXHandler(&sax);
+            sax.endElement = EndElement;
+
+            ctxt = htmlCreatePushParserCtxt(&sax,nullptr,nullptr,0,"",XML_CHAR_ENCODING_NONE);
+            LXML_CHECK(ctxt != nullptr);
+            ctxt->_private = this;
+            htmlCtxtUseOptions(ctxt,opt);
+            if(encoding != nullptr){
+                xmlCtxtResetPush(ctxt,nullptr,0,nullptr,encoding);
+                ctxt->_private = this;
+                htmlCtxtUseOptions(ctxt,opt);
+            }
+        }
+        PushParser(const PushParser &) = delete;
+        ~PushParser() {
+            if(ctxt != nullptr){
+                xmlFreeDoc(ctxt->myDoc);
+                htmlFreeParserCtxt(ctxt);
+            }
+        }
+
+        /**
+         * @brief Feed a chunk of the data
+         * 
+         * @return false on a fatal error
+         */
+        bool feed(const char *data,size_t size) {
+            LXML_CHECK(!finished);
+            //The push parser may stall on a tag split between two chunks,
+            //so only pass the data up to the last complete tag
+            pending.append(data,size);
+            auto end = pending.rfind('>');
+            if(end == u8string::npos){
+                return true;
+            }
+            int ret = htmlParseChunk(ctxt,pending.data(),int(end + 1),0);
+            pending.erase(0,end + 1);
+            return ret == 0;
+        }
+        /**
+         * @brief Watch for an element,the expression is evaluated (by the XPathRegistry)
+         *        with each closed element as the context node,so the cost does not grow with the document
+         * 
+         * @param expr Zero terminated,relative to the element,like self::div[@class="x"]
+         */
+        void watch(const char *expr) {
+            watching = expr;
+            matched = false;
+        }
+        /**
+         * @brief Is an element of the watched expression completely parsed
+         * 
+         */
+        bool seen() const {
+            return matched;
+        }
+        /**
+         * @brief The document parsed so far
+         * 
+         */
+        DocumentRef document() const {
+            return DocumentRef(ctxt->myDoc);
+        }
+        /**
+         * @brief End the parsing,the rest of the document is dropped if we ended early
+         * 
+         * @return HtmlDocument 
+         */
+        HtmlDocument finish() {
+            LXML_CHECK(!finished);
+            finished = true;
+            htmlParseChunk(ctxt,pending.data(),int(pending.size()),1);
+            pending.clear();
+            xmlDocPtr doc = ctxt->myDoc;
+            ctxt->myDoc = nullptr;
+            return HtmlDocument(doc);
+        }
+    private:
+        static void EndElement(void *ctx,const xmlChar *name) {
+            auto c = static_cast<htmlParserCtxtPtr>(ctx);
+            auto self = static_cast<PushParser*>(c->_private);
+            //The node is still the current one before the default handler pops it
+            if(self != nullptr && self->watching != nullptr && !self->matched && c->node != nullptr){
+                auto obj = XPathRegistry::Instance().eval(NodeRef(c->node),self->watching);
+                self->matched = !obj.is_null() && obj.is_nodeset() && obj.as_nodeset().size() > 0;
+            }
+            xmlSAX2EndElement(ctx,name);
+        }
 
-LXML_NS_END
\ No newline at end of file
+        htmlParserCtxtPtr ctxt = nullptr;
+        u8string pending;//< After the last '>' we got
+        const char *watching = nullptr;
+        bool matched = false;
+        bool finished = false;
+};
+LXML_NS_END
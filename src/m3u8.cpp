@@ -0,0 +1,449 @@
+#include "common/m3u8.hpp"
+#include "common/scheduler.hpp"
+#include "libs/aes.hpp"
+
+#include <QTimer>
+#include <QDebug>
+#include <cstring>
+
+PLAYER_NS_BEGIN
+
+namespace {
+
+/**
+ * @brief Check the text begin with the tag,move after it if it does
+ *
+ */
+template <size_t N>
+inline bool TagIs(const char *&p,const char *end,const char (&tag)[N]){
+    if(size_t(end - p) < N - 1 || std::memcmp(p,tag,N - 1) != 0){
+        return false;
+    }
+    p += N - 1;
+    return true;
+}
+template <size_t N>
+inline bool Equal(const char *p,const char *end,const char (&str)[N]){
+    return size_t(end - p) == N - 1 && std::memcmp(p,str,N - 1) == 0;
+}
+//No copy,only view the bytes
+inline QByteArray View(const char *p,const char *end){
+    return QByteArray::fromRawData(p,int(end - p));
+}
+inline qint64 ToInteger(const char *p,const char *end){
+    return View(p,end).toLongLong();
+}
+//Seconds to ms
+inline qint64 ToMs(const char *p,const char *end){
+    return qint64(View(p,end).toDouble() * 1000 + 0.5);
+}
+inline QUrl ResolveUri(const char *p,const char *end,const QUrl &base){
+    QUrl url = QUrl::fromEncoded(View(p,end));
+    if(url.isRelative()){
+        return base.resolved(url);
+    }
+    return url;
+}
+
+/**
+ * @brief Reader of the attribute list (NAME=VALUE,NAME="VALUE")
+ *
+ */
+class AttributeReader {
+    public:
+        AttributeReader(const char *p,const char *end) : cur(p), end(end) {}
+
+        bool next(){
+            while(cur < end && (*cur == ',' || *cur == ' ')){
+                ++cur;
+            }
+            if(cur >= end){
+                return false;
+            }
+            name = cur;
+            while(cur < end && *cur != '='){
+                ++cur;
+            }
+            name_end = cur;
+            if(cur >= end){
+                return false;
+            }
+            ++cur;
+            if(cur < end && *cur == '"'){
+                //Quoted string,may contains ','
+                value = ++cur;
+                while(cur < end && *cur != '"'){
+                    ++cur;
+                }
+                value_end = cur;
+                if(cur < end){
+                    ++cur;
+                }
+            }
+            else{
+                value = cur;
+                while(cur < end && *cur != ','){
+                    ++cur;
+                }
+                value_end = cur;
+            }
+            return true;
+        }
+        template <size_t N>
+        bool is(const char (&str)[N]) const {
+            return Equal(name,name_end,str);
+        }
+
+        const char *name = nullptr;
+        const char *name_end = nullptr;
+        const char *value = nullptr;
+        const char *value_end = nullptr;
+    private:
+        const char *cur;
+        const char *end;
+};
+
+}
+
+bool M3U8Playlist::parse(const QByteArray &data,const QUrl &base){
+    const char *p = data.constData();
+    const char *end = p + data.size();
+
+    //Skip UTF-8 BOM
+    if(end - p >= 3 && std::memcmp(p,"\xEF\xBB\xBF",3) == 0){
+        p += 3;
+    }
+    if(!TagIs(p,end,"#EXTM3U")){
+        return false;
+    }
+
+    //State of the next segment / variant
+    qint64 seg_duration = -1;
+    qint64 range_length = -1;
+    qint64 range_offset = -1;
+    qint64 next_offset = 0;//< Byte range without offset follows the previous one
+    bool discontinuity = false;
+    bool stream_inf = false;
+    int key = -1;
+    Variant variant;
+
+    while(p < end){
+        auto eol = static_cast<const char*>(std::memchr(p,'\n',end - p));
+        if(eol == nullptr){
+            eol = end;
+        }
+        const char *line = p;
+        const char *line_end = eol;
+        p = eol + 1;
+
+        while(line_end > line && (line_end[-1] == '\r' || line_end[-1] == ' ' || line_end[-1] == '\t')){
+            --line_end;
+        }
+        while(line < line_end && (*line == ' ' || *line == '\t')){
+            ++line;
+        }
+        if(line == line_end){
+            continue;
+        }
+
+        if(*line != '#'){
+            //Uri
+            if(stream_inf){
+                variant.url = ResolveUri(line,line_end,base);
+                variants.push_back(variant);
+                variant = Variant();
+                stream_inf = false;
+            }
+            else if(seg_duration >= 0){
+                Segment seg;
+                seg.url = ResolveUri(line,line_end,base);
+                seg.start = duration;
+                seg.duration = seg_duration;
+                seg.sequence = media_sequence + segments.size();
+                seg.key = key;
+                seg.discontinuity = discontinuity;
+                if(range_length >= 0){
+                    seg.offset = range_offset >= 0 ? range_offset : next_offset;
+                    seg.length = range_length;
+                    next_offset = seg.offset + seg.length;
+                }
+                segments.push_back(seg);
+                duration += seg_duration;
+
+                seg_duration = -1;
+                range_length = -1;
+                range_offset = -1;
+                discontinuity = false;
+            }
+            continue;
+        }
+
+        const char *cur = line;
+        if(TagIs(cur,line_end,"#EXTINF:")){
+            //#EXTINF:<duration>,[<title>]
+            auto comma = static_cast<const char*>(std::memchr(cur,',',line_end - cur));
+            seg_duration = ToMs(cur,comma != nullptr ? comma : line_end);
+        }
+        else if(TagIs(cur,line_end,"#EXT-X-BYTERANGE:")){
+            //#EXT-X-BYTERANGE:<n>[@<o>]
+            auto at = static_cast<const char*>(std::memchr(cur,'@',line_end - cur));
+            range_length = ToInteger(cur,at != nullptr ? at : line_end);
+            range_offset = at != nullptr ? ToInteger(at + 1,line_end) : -1;
+        }
+        else if(TagIs(cur,line_end,"#EXT-X-KEY:")){
+            Key k;
+            AttributeReader reader(cur,line_end);
+            while(reader.next()){
+                if(reader.is("METHOD")){
+                    k.method = QByteArray(reader.value,int(reader.value_end - reader.value));
+                }
+                else if(reader.is("URI")){
+                    k.uri = ResolveUri(reader.value,reader.value_end,base);
+                }
+                else if(reader.is("IV")){
+                    //0x followed by 32 hex digits
+                    const char *hex = reader.value;
+                    if(reader.value_end - hex > 2 && hex[0] == '0' && (hex[1] == 'x' || hex[1] == 'X')){
+                        hex += 2;
+                    }
+                    k.iv = QByteArray::fromHex(View(hex,reader.value_end));
+                    if(k.iv.size() < 16){
+                        k.iv.prepend(QByteArray(16 - k.iv.size(),'\0'));
+                    }
+                }
+            }
+            if(k.method.isEmpty() || k.method == "NONE"){
+                key = -1;
+            }
+            else{
+                keys.push_back(k);
+                key = keys.size() - 1;
+            }
+        }
+        else if(Equal(line,line_end,"#EXT-X-DISCONTINUITY")){
+            discontinuity = true;
+        }
+        else if(TagIs(cur,line_end,"#EXT-X-MEDIA-SEQUENCE:")){
+            media_sequence = ToInteger(cur,line_end);
+        }
+        else if(TagIs(cur,line_end,"#EXT-X-TARGETDURATION:")){
+            target_duration = ToInteger(cur,line_end) * 1000;
+        }
+        else if(Equal(line,line_end,"#EXT-X-ENDLIST")){
+            ended = true;
+        }
+        else if(TagIs(cur,line_end,"#EXT-X-STREAM-INF:")){
+            AttributeReader reader(cur,line_end);
+            while(reader.next()){
+                if(reader.is("BANDWIDTH")){
+                    variant.bandwidth = ToInteger(reader.value,reader.value_end);
+                }
+                else if(reader.is("RESOLUTION")){
+                    variant.resolution = QByteArray(reader.value,int(reader.value_end - reader.value));
+                }
+                else if(reader.is("CODECS")){
+                    variant.codecs = QByteArray(reader.value,int(reader.value_end - reader.value));
+                }
+            }
+            stream_inf = true;
+        }
+        //Other tags and comments are ignored
+    }
+    return true;
+}
+int M3U8Playlist::bestVariant() const{
+    int best = -1;
+    for(int i = 0;i < variants.size();i++){
+        if(best < 0 || variants[i].bandwidth > variants[best].bandwidth){
+            best = i;
+        }
+    }
+    return best;
+}
+bool M3U8Playlist::isEncrypted() const{
+    for(const auto &seg : segments){
+        if(seg.key >= 0){
+            return true;
+        }
+    }
+    return false;
+}
+QByteArray M3U8Playlist::ivOf(const Key &key,qint64 sequence){
+    if(key.iv.size() == Aes::BlockSize){
+        return key.iv;
+    }
+    QByteArray iv(Aes::BlockSize,'\0');
+    for(int i = 0;i < 8;i++){
+        iv[Aes::BlockSize - 1 - i] = char((quint64(sequence) >> (8 * i)) & 0xFF);
+    }
+    return iv;
+}
+
+//--M3U8KeyCache
+M3U8KeyCache *M3U8KeyCache::instance(){
+    static M3U8KeyCache cache;
+    return &cache;
+}
+void M3U8KeyCache::get(QNetworkAccessManager *manager,const QNetworkRequest &request,QObject *context,Callback callback){
+    QUrl url = request.url();
+    auto iter = keys.find(url);
+    if(iter != keys.end()){
+        //Keep it async like the network
+        QByteArray key = iter.value();
+        QTimer::singleShot(0,context,[callback,key](){
+            callback(key,QString());
+        });
+        return;
+    }
+    auto waiter = pending.find(url);
+    if(waiter != pending.end()){
+        waiter->push_back(Waiter{context,callback});
+        return;
+    }
+    pending[url].push_back(Waiter{context,callback});
+
+    QNetworkRequest req(request);
+    NetworkScheduler::setStage(req,"key");
+    auto reply = NetworkScheduler::instance()->get(manager,req,NetworkScheduler::Playback);
+    connect(reply,&QNetworkReply::finished,this,[this,reply,url](){
+        replyFinished(reply,url);
+    });
+}
+void M3U8KeyCache::replyFinished(QNetworkReply *reply,const QUrl &url){
+    reply->deleteLater();
+
+    auto waiters = pending.take(url);
+    QByteArray key;
+    QString err;
+    if(reply->error()){
+        err = reply->errorString();
+    }
+    else{
+        key = reply->readAll();
+        if(key.size() != int(Aes::KeySize)){
+            err = QString("Invalid key size %1").arg(key.size());
+            key.clear();
+        }
+        else{
+            keys.insert(url,key);
+        }
+    }
+    for(const auto &w : waiters){
+        if(w.context != nullptr){
+            w.callback(key,err);
+        }
+    }
+}
+
+//--DecryptStream
+struct DecryptStream::Cipher {
+    Aes::CbcStream stream;
+};
+
+DecryptStream::DecryptStream(QNetworkAccessManager *manager,const QNetworkRequest &request,const QUrl &key,const QByteArray &iv,QIODevice *source,QObject *parent):
+    QIODevice(parent),source(source),iv(iv){
+
+    //The key is from the same site,send the same headers
+    QNetworkRequest key_request(request);
+    key_request.setUrl(key);
+    key_request.setRawHeader("Range",QByteArray());
+    M3U8KeyCache::instance()->get(manager,key_request,this,[this](const QByteArray &key,const QString &error){
+        keyReady(key,error);
+    });
+
+    source->setParent(this);
+    if(source->isSequential()){
+        connect(source,&QIODevice::readyRead,this,&DecryptStream::sourceReadyRead);
+        connect(source,&QIODevice::readChannelFinished,this,&DecryptStream::sourceFinished);
+    }
+    else{
+        //A local file,all is here
+        pending = source->readAll();
+        source_done = true;
+    }
+
+    open(QIODevice::ReadOnly);
+}
+DecryptStream::~DecryptStream(){
+    source->disconnect(this);
+}
+void DecryptStream::keyReady(const QByteArray &key,const QString &error){
+    if(!error.isEmpty() || iv.size() != int(Aes::BlockSize)){
+        mplayerDebug() << "Failed to get the key" << error;
+        source->disconnect(this);
+        finished = true;
+        emit readChannelFinished();
+        return;
+    }
+    cipher.reset(new Cipher);
+    cipher->stream.reset(reinterpret_cast<const uint8_t*>(key.constData()),reinterpret_cast<const uint8_t*>(iv.constData()));
+
+    //Catch up with the data received before it
+    if(!pending.isEmpty()){
+        decrypt(pending);
+        pending.clear();
+    }
+    if(source_done){
+        finish();
+    }
+}
+void DecryptStream::sourceReadyRead(){
+    QByteArray data = source->readAll();
+    if(cipher == nullptr){
+        pending.append(data);
+        return;
+    }
+    decrypt(data);
+}
+void DecryptStream::sourceFinished(){
+    //Take the rest
+    sourceReadyRead();
+    source_done = true;
+    if(cipher != nullptr){
+        finish();
+    }
+}
+void DecryptStream::decrypt(const QByteArray &data){
+    if(data.isEmpty()){
+        return;
+    }
+    //Plaintext of the previous call may be released
+    int begin = output.size();
+    output.resize(begin + data.size() + int(Aes::BlockSize));
+    size_t n = cipher->stream.update(
+        reinterpret_cast<const uint8_t*>(data.constData()),
+        data.size(),
+        reinterpret_cast<uint8_t*>(output.data()) + begin
+    );
+    output.resize(begin + int(n));
+    if(n > 0){
+        emit readyRead();
+    }
+}
+void DecryptStream::finish(){
+    if(finished){
+        return;
+    }
+    uint8_t tail[Aes::BlockSize];
+    long n = cipher->stream.finish(tail);
+    if(n < 0){
+        mplayerDebug() << "Encrypted segment is truncated or not padded";
+    }
+    else if(n > 0){
+        output.append(reinterpret_cast<const char*>(tail),int(n));
+        emit readyRead();
+    }
+    finished = true;
+    emit readChannelFinished();
+}
+qint64 DecryptStream::readData(char *data,qint64 max){
+    if(output.isEmpty()){
+        return finished ? -1 : 0;
+    }
+    qint64 n = qMin<qint64>(max,output.size());
+    std::memcpy(data,output.constData(),n);
+    output.remove(0,n);
+    return n;
+}
+
+PLAYER_NS_END
@@ -7,6 +7,10 @@ using namespace PLAYER_NS;
 
 int main(int argc,char **argv){
     QApplication a(argc,argv);
+    //For QSettings / QStandardPaths
+    QApplication::setOrganizationName("BusyStudent");
+    QApplication::setApplicationName("QBilibiliPlayer");
+
     App w;
     w.show();
 
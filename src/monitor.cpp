@@ -0,0 +1,111 @@
+#include "common/monitor.hpp"
+
+#include <QDebug>
+
+PLAYER_NS_BEGIN
+
+void PlaybackMonitor::reset(){
+    if(is_stalled){
+        resumed();
+    }
+    if(stall_count > 0){
+        mplayerDebug() << "Session stalls" << stall_count << "time" << stall_time << "ms";
+    }
+    last_received = -1;
+    last_segment = -1;
+    prefetch_segment = -1;
+    download_rate = -1;
+    prefetch_rate = -1;
+    stall_count = 0;
+    stall_time = 0;
+    starve_timer.invalidate();
+}
+void PlaybackMonitor::sample(int segment,qint64 received,qreal bitrate,qint64 ahead,bool playing,qreal rate){
+    if(segment != last_segment || !sample_timer.isValid() || bitrate <= 0 || received < last_received){
+        //New download,start again
+        last_segment = segment;
+        last_received = received;
+        sample_timer.start();
+        return;
+    }
+    qint64 elapsed = sample_timer.restart();
+    if(elapsed <= 0){
+        return;
+    }
+    //Bytes per ms received,in media ms
+    qreal rate_now = qreal(received - last_received) / elapsed / bitrate;
+    last_received = received;
+
+    if(download_rate < 0){
+        download_rate = rate_now;
+    }
+    else{
+        download_rate = download_rate * 0.8 + rate_now * 0.2;
+    }
+
+    if(playing && !is_stalled && download_rate < rate){
+        //Projected time to run out
+        qreal drain = rate - download_rate;
+        if(ahead / drain < PLAYER_STARVE_TIME){
+            mplayerDebug() << "Buffer runs out in" << qint64(ahead / drain) << "ms,download rate" << download_rate;
+            _starving(segment);
+        }
+    }
+}
+void PlaybackMonitor::prefetchStarted(int segment){
+    prefetch_segment = segment;
+    prefetch_timer.start();
+}
+void PlaybackMonitor::prefetchDone(int segment,qint64 duration){
+    if(segment != prefetch_segment || !prefetch_timer.isValid()){
+        return;
+    }
+    qint64 elapsed = qMax<qint64>(prefetch_timer.elapsed(),1);
+    prefetch_rate = qreal(duration) / elapsed;
+    prefetch_segment = -1;
+    prefetch_timer.invalidate();
+    mplayerDebug() << "Prefetch segment" << segment << "rate" << prefetch_rate;
+}
+void PlaybackMonitor::checkPrefetch(qint64 remaining){
+    if(prefetch_segment < 0 || !prefetch_timer.isValid()){
+        return;
+    }
+    //Still loading when the current one is about to end
+    if(remaining < PLAYER_STARVE_TIME && prefetch_timer.elapsed() > PLAYER_STARVE_TIME){
+        mplayerDebug() << "Prefetch of segment" << prefetch_segment << "is too slow";
+        _starving(prefetch_segment);
+    }
+}
+void PlaybackMonitor::stalled(){
+    if(is_stalled){
+        return;
+    }
+    is_stalled = true;
+    stall_count += 1;
+    stall_timer.start();
+    emit stallStarted();
+}
+void PlaybackMonitor::resumed(){
+    if(!is_stalled){
+        return;
+    }
+    is_stalled = false;
+    qint64 duration = stall_timer.elapsed();
+    stall_time += duration;
+    emit stallEnded(duration);
+}
+qint64 PlaybackMonitor::stallTime() const {
+    if(is_stalled){
+        return stall_time + stall_timer.elapsed();
+    }
+    return stall_time;
+}
+void PlaybackMonitor::_starving(int segment){
+    if(starve_timer.isValid() && starve_timer.elapsed() < PLAYER_STARVE_COOLDOWN){
+        return;
+    }
+    starve_timer.start();
+    emit starving(segment);
+}
+
+PLAYER_NS_END
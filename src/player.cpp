@@ -10,6 +10,58 @@
 
 PLAYER_NS_BEGIN
 
+//--MediaClock
+qint64 MediaClock::_rawTime() const {
+    if(!running){
+        return base;
+    }
+    qint64 elapsed = timer.elapsed();
+    qreal t = base + elapsed * play_rate + correction * qMin<qint64>(elapsed,PLAYER_CLOCK_SLEW);
+    return qint64(t);
+}
+void MediaClock::_rebase(){
+    base = _rawTime();
+    correction = 0;
+    timer.restart();
+}
+qint64 MediaClock::time() const {
+    last = qMax(last,_rawTime());
+    return last;
+}
+void MediaClock::update(qint64 reported){
+    if(!running){
+        reset(reported);
+        return;
+    }
+    qint64 now = _rawTime();
+    qint64 drift = reported - now;
+    if(qAbs(drift) > PLAYER_CLOCK_SNAP){
+        reset(reported);
+        return;
+    }
+    //Catch up the drift in PLAYER_CLOCK_SLEW,but never change the speed more than 10%
+    base = now;
+    timer.restart();
+    correction = qBound(-0.1 * play_rate,qreal(drift) / PLAYER_CLOCK_SLEW,0.1 * play_rate);
+}
+void MediaClock::reset(qint64 position){
+    base = position;
+    last = position;
+    correction = 0;
+    timer.restart();
+}
+void MediaClock::setRunning(bool r){
+    if(r == running){
+        return;
+    }
+    _rebase();
+    running = r;
+}
+void MediaClock::setRate(qreal rate){
+    _rebase();
+    play_rate = rate;
+}
+
 MediaPlayer::MediaPlayer(QObject *parent) : QObject(parent){
     //Create mediaplayer
     QMediaPlayer *arr [] = {
@@ -39,13 +91,21 @@ MediaPlayer::MediaPlayer(QObject *parent) : QObject(parent){
     player1.setVideoOutput(player1_item);
     player2.setVideoOutput(player2_item);
 
+    connect(&monitor,&PlaybackMonitor::starving,this,&MediaPlayer::_failover);
+    connect(SegmentCache::instance(),&SegmentCache::segmentReady,this,&MediaPlayer::_segmentReady);
+
     // player1_item->hide();
     // player2_item->hide();
+
+    buffer_timer = startTimer(PLAYER_BUFFER_INTERVAL);
 }
 MediaPlayer::~MediaPlayer(){
     //Stop all players
     player1.stop();
     player2.stop();
+    delete flv_stream;
+    delete segment_streams[0];
+    delete segment_streams[1];
 }
 void MediaPlayer::setVideoOutput(QGraphicsScene *scene){
     scene->addItem(player1_item);
@@ -53,6 +113,7 @@ void MediaPlayer::setVideoOutput(QGraphicsScene *scene){
 }
 void MediaPlayer::setMedia(VideoResource *res){
     resource = res;
+    media_generation += 1;
 
     QMediaPlayer *arr [] = {
         &player1,
@@ -65,18 +126,30 @@ void MediaPlayer::setMedia(VideoResource *res){
     }
     currentPlayer = &player1;
     cur_segment = 0;
-    //Set media
-    player1.setMedia(resource->videos[0]);
+    stream_seek = -1;
+    loads_canceled = false;
+    _resetCaching();
+    _resetFlv();
+    clock.setRunning(false);
+    clock.reset(0);
+    monitor.reset();
+    //Set media,a flv is read through our stream so the window can hold it
+    if(_isFlv()){
+        //Build the keyframe index for fast seeking
+        FlvIndexCache::instance()->fetch(manager,resource->videos[0].canonicalRequest());
+        _playFlv(FlvIndex::Keyframe{0,0});
+    }
+    else{
+        _loadSegment(&player1,0);
+    }
+    ConnectionWarmer::instance()->remember(resource->videos[0].canonicalUrl());
     player1.setMuted(false);
     
     player1_item->show();
     player2_item->hide();
 
-    if(!resource->single_video){
-        //Begin caching
-        player2.setMedia(resource->videos[1]);
-        player2.play();
-    }
+    //Caching the next segment when the window allows it
+    _updateBuffer();
 }
 void MediaPlayer::setOutputRect(qreal x,qreal y,qreal w,qreal h){
     player1_item->setPos(x,y);
@@ -98,6 +171,23 @@ void MediaPlayer::pause(){
 }
 void MediaPlayer::setPosition(qint64 pos){
     if(resource->single_video){
+        //An aborted stream is replaced below anyway
+        loads_canceled = false;
+        if(_seekFlv(pos)){
+            return;
+        }
+        clock.reset(pos);
+        if(flv_stream != nullptr){
+            //Can not seek in the stream,back to the whole video
+            bool playing = currentPlayer->state() == QMediaPlayer::PlayingState;
+            currentPlayer->stop();
+            _loadSegment(currentPlayer,0);
+            _resetFlv();
+            currentPlayer->play();
+            if(!playing){
+                currentPlayer->pause();
+            }
+        }
         currentPlayer->setPosition(pos);
         return;        
     }
@@ -112,8 +202,31 @@ void MediaPlayer::setPosition(qint64 pos){
         cur += 1;
     }
     if(where == -1){
-        //Not found
-        //TODO: 
+        //Out of the segments,take the end of the last one
+        if(resource->segments.isEmpty()){
+            return;
+        }
+        where = resource->segments.size() - 1;
+        const auto &last = resource->segments[where];
+        pos = qBound(last.start,pos,last.start + last.duration);
+    }
+    clock.reset(pos);
+    stream_seek = -1;
+    if(loads_canceled){
+        //The download of it is aborted,reload it even in the same segment
+        loads_canceled = false;
+    }
+    else if(where == qint64(cur_segment) && !_isStreaming(currentPlayer)){
+        //Same segment,no need to reload it
+        currentPlayer->setPosition(pos - resource->segments[where].start);
+        _updateBuffer();
+        return;
+    }
+    else if(where == qint64(cur_segment) && !SegmentCache::instance()->contains(SegmentCache::keyOf(resource->videos[where].canonicalRequest()))){
+        //A decrypting stream can not seek,seek once the segment is downloaded
+        mplayerDebug() << "Seek in segment" << where << "when it is downloaded";
+        stream_seek = pos - resource->segments[where].start;
+        return;
     }
     QMediaPlayer *arr [] = {
         &player1,
@@ -127,22 +240,52 @@ void MediaPlayer::setPosition(qint64 pos){
     }
     cur_segment = where;
     currentPlayer = &player1;
+    _resetCaching();
     //Set media
-    player1.setMedia(resource->videos[where]);
+    _loadSegment(&player1,where);
     player1.setMuted(false);
     player1_item->show();
     player2_item->hide();
 
     player1.setPosition(pos - resource->segments[where].start);
+    if(_isStreaming(&player1) && pos > resource->segments[where].start){
+        //Ignored by the stream,do it once downloaded
+        stream_seek = pos - resource->segments[where].start;
+    }
     player1.play();
     if(!cur_playing){
         player1.pause();
     }
 
     //Cache it if could
-    if(where < resource->segments.size() - 1){
-        player2.setMedia(resource->videos[where + 1]);
-        player2.play();
+    _updateBuffer();
+}
+void MediaPlayer::setPlaybackRate(qreal rate){
+    player1.setPlaybackRate(rate);
+    player2.setPlaybackRate(rate);
+    clock.setRate(rate);
+}
+void MediaPlayer::cancelLoading(){
+    if(resource == nullptr){
+        return;
+    }
+    if(resource->single_video){
+        if(flv_stream != nullptr){
+            //The seek plays a new stream from its keyframe
+            flv_stream->abort();
+            loads_canceled = true;
+        }
+        return;
+    }
+    if(next_caching){
+        //The seek will decide which segment is the next
+        _stopCaching(true);
+    }
+    QString key = SegmentCache::keyOf(resource->videos[cur_segment].canonicalRequest());
+    if(_isStreaming(currentPlayer) && !SegmentCache::instance()->contains(key)){
+        //The seek reloads it,the downloaded bytes are kept for it
+        SegmentCache::instance()->cancel(key);
+        loads_canceled = true;
     }
 }
 
@@ -153,7 +296,9 @@ void MediaPlayer::_playerError(QMediaPlayer::Error e){
 void MediaPlayer::_playerDurationChanged(qint64 duration){
     //Emit duration changed
     if(resource->single_video){
-        emit durationChanged(duration);
+        if(sender() == currentPlayer){
+            emit durationChanged(this->duration());
+        }
     }
     else{
         //Means this video is ready to play
@@ -165,6 +310,9 @@ void MediaPlayer::_playerDurationChanged(qint64 duration){
             mplayerDebug() << _nameOfPlayer(sender()) << "Cached done,pause";
             
             _nextPlayer()->pause();
+            next_caching = false;
+            next_cached = true;
+            monitor.prefetchDone(cur_segment + 1,resource->segments[cur_segment + 1].duration);
         }
     }
     // emit durationChanged(duration);
@@ -173,16 +321,21 @@ void MediaPlayer::_playerPositionChanged(qint64 position){
     //Emit position changed
     if(resource->single_video){
         //Just forward
-        emit positionChanged(position);
+        clock.update(stream_offset + position);
+        emit positionChanged(stream_offset + position);
         return;
     }
     if(sender() == currentPlayer){
+        clock.update(resource->segments[cur_segment].start + position);
         emit positionChanged(resource->segments[cur_segment].start + position);
     }
 }
 void MediaPlayer::_playerStateChanged(QMediaPlayer::State state){
     //Emit state changed
     // emit stateChanged(state);
+    if(sender() == currentPlayer){
+        clock.setRunning(state == QMediaPlayer::PlayingState);
+    }
     if(resource->single_video){
         //Just forward
         emit stateChanged(state);
@@ -193,6 +346,17 @@ void MediaPlayer::_playerMediaStatusChanged(QMediaPlayer::MediaStatus status){
     //Emit media status changed
     // emit mediaStatusChanged(status);
     mplayerDebug() << _nameOfPlayer(sender()) <<"Media status changed" << status;
+    if(sender() == currentPlayer){
+        //The clock should not run while stalled
+        if(status == QMediaPlayer::StalledMedia){
+            clock.setRunning(false);
+            monitor.stalled();
+        }
+        else if(status == QMediaPlayer::BufferedMedia){
+            clock.setRunning(currentPlayer->state() == QMediaPlayer::PlayingState);
+            monitor.resumed();
+        }
+    }
     if(resource->single_video){
         if(status == QMediaPlayer::EndOfMedia){
             //Just forward
@@ -205,6 +369,7 @@ void MediaPlayer::_playerMediaStatusChanged(QMediaPlayer::MediaStatus status){
         mplayerDebug() << _nameOfPlayer(sender()) << "Switch to next segment";
         if(cur_segment < resource->segments.size() - 1){
             cur_segment++;
+            stream_seek = -1;
 
             mplayerDebug() << "From " << _currentPlayerName() << " to " << _nextPlayerName();
 
@@ -214,21 +379,26 @@ void MediaPlayer::_playerMediaStatusChanged(QMediaPlayer::MediaStatus status){
 
             currentPlayer = _nextPlayer();
 
+            //The window was full, the next segment is not fetched yet
+            if(!next_caching && !next_cached && !next_paused){
+                mplayerDebug() << "Next segment not cached,load it now";
+                _loadSegment(currentPlayer,cur_segment);
+            }
+            _resetCaching();
+
             //Switch to next segment
             currentPlayer->setMuted(false);
             _currentVideoItem()->show();
             currentPlayer->play();
 
             //Let next player to cache if needed
-            if(cur_segment < resource->segments.size() - 1){
-                _nextPlayer()->setMedia(resource->videos[cur_segment + 1]);
-                _nextPlayer()->play();
-            }
+            _updateBuffer();
         
         }
         else{
             //Stop
             currentPlayer->stop();
+            emit mediaStatusChanged(QMediaPlayer::EndOfMedia);
         }
     }
     else if(sender() == currentPlayer){
@@ -243,6 +413,7 @@ void MediaPlayer::_playerBufferStatusChanged(int percent){
     if(sender() == currentPlayer){
         mplayerDebug() << "currentPlayer Buffer status changed" << percent;
         emit bufferStatusChanged(percent);
+        _updateBuffer();
     }
     else{
         mplayerDebug() << "nextPlayer Buffer status changed" << percent;
@@ -263,7 +434,7 @@ void MediaPlayer::_playerVolumeChanged(int vol){
 
 qint64 MediaPlayer::position() const {
     if(resource->single_video){
-        return currentPlayer->position();
+        return stream_offset + currentPlayer->position();
     }
     else{
         return resource->segments[cur_segment].start + currentPlayer->position();
@@ -271,6 +442,9 @@ qint64 MediaPlayer::position() const {
 }
 qint64 MediaPlayer::duration() const  {
     if(resource->single_video){
+        if(stream_duration >= 0){
+            return stream_duration;
+        }
         return currentPlayer->duration();
     }
     else{
@@ -281,6 +455,475 @@ qint64 MediaPlayer::volume() const {
     return currentPlayer->volume();
 }
 
+//--Buffer window
+void MediaPlayer::setBufferWindow(qint64 ms){
+    mplayerDebug() << "Buffer window" << ms << "ms";
+    buffer_window = ms;
+    _updateBuffer();
+}
+qint64 MediaPlayer::_segmentEnd() const {
+    if(resource->single_video){
+        return duration();
+    }
+    const auto &seg = resource->segments[cur_segment];
+    return seg.start + seg.duration;
+}
+qint64 MediaPlayer::_segmentsBuffered(int *edge) const {
+    auto cache = SegmentCache::instance();
+    qint64 end = resource->segments[cur_segment].start;
+    if(edge != nullptr){
+        *edge = -1;
+    }
+    for(int i = cur_segment;i < resource->segments.size();i++){
+        const auto &seg = resource->segments[i];
+        QString key = SegmentCache::keyOf(resource->videos[i].canonicalRequest());
+        qint64 got = 0;
+        qint64 total = -1;
+        if(!cache->progress(key,&got,&total) || total < 0 || got < total){
+            //The bytes of it against its bitrate
+            if(total > 0){
+                end += seg.duration * got / total;
+            }
+            if(edge != nullptr){
+                *edge = i;
+            }
+            break;
+        }
+        end += seg.duration;
+    }
+    return end;
+}
+qint64 MediaPlayer::bufferedAhead() const {
+    if(resource == nullptr){
+        return 0;
+    }
+    if(resource->single_video){
+        if(flv_stream == nullptr){
+            //The backend is reading the url,we can not see the bytes
+            return -1;
+        }
+        //Timestamp of the last tag received
+        return qMax<qint64>(flv_stream->receivedTime() - position(),0);
+    }
+    if(manager == nullptr){
+        return -1;
+    }
+    return qMax<qint64>(_segmentsBuffered() - position(),0);
+}
+void MediaPlayer::_resetCaching(){
+    //The probes are for the previous segment / media
+    _abortProbes();
+    next_paused = false;
+    next_caching = false;
+    next_cached = false;
+    if(!held_segment.isEmpty()){
+        SegmentCache::instance()->hold(held_segment,false);
+        held_segment.clear();
+    }
+}
+void MediaPlayer::_beginCaching(){
+    mplayerDebug() << _nextPlayerName() << "Begin caching segment" << cur_segment + 1;
+    next_caching = true;
+    if(next_paused){
+        //Continue the download paused by a full window
+        next_paused = false;
+    }
+    else{
+        _loadSegment(_nextPlayer(),cur_segment + 1);
+    }
+    _nextPlayer()->play();
+    monitor.prefetchStarted(cur_segment + 1);
+}
+void MediaPlayer::_stopCaching(bool drop){
+    next_caching = false;
+    next_cached = false;
+    if(!drop){
+        //Keep what is downloaded,resume it at the low watermark
+        mplayerDebug() << _nextPlayerName() << "Window is full,pause caching";
+        _nextPlayer()->pause();
+        next_paused = true;
+        return;
+    }
+    mplayerDebug() << _nextPlayerName() << "Drop caching";
+    next_paused = false;
+    _nextPlayer()->stop();
+    //Release the stream
+    _unloadSegment(_nextPlayer());
+}
+void MediaPlayer::_updateBuffer(){
+    if(resource == nullptr){
+        return;
+    }
+    qint64 ahead = bufferedAhead();
+    if(ahead < 0){
+        //Not read through our streams,the backend buffers it
+        return;
+    }
+    int edge = -1;
+    QString edge_key;
+    if(!resource->single_video){
+        _segmentsBuffered(&edge);
+        if(edge >= 0){
+            edge_key = SegmentCache::keyOf(resource->videos[edge].canonicalRequest());
+        }
+    }
+    //Everything is downloaded,watch the prefetching instead
+    bool downloading = resource->single_video ? !flv_stream->isFinished() : edge >= 0;
+    bool held = resource->single_video ? flv_stream->isHeld() : !held_segment.isEmpty();
+    if(downloading && !held && !loads_canceled){
+        //The bytes we received for the playhead against the bitrate
+        qint64 received = 0;
+        qreal bitrate = 0;
+        if(resource->single_video){
+            received = flv_stream->received();
+            bitrate = flv_stream->bitrate();
+        }
+        else{
+            qint64 total = -1;
+            SegmentCache::instance()->progress(edge_key,&received,&total);
+            if(total > 0 && resource->segments[edge].duration > 0){
+                bitrate = qreal(total) / resource->segments[edge].duration;
+            }
+        }
+        monitor.sample(resource->single_video ? 0 : edge,received,bitrate,ahead,currentPlayer->state() == QMediaPlayer::PlayingState,clock.rate());
+    }
+    else{
+        monitor.skipSample();
+    }
+    //Enforce the window where the bytes come in,stop reading the reply when it is full
+    if(resource->single_video){
+        if(ahead >= buffer_window){
+            flv_stream->hold(true);
+        }
+        else if(ahead < buffer_window / 2){
+            flv_stream->hold(false);
+        }
+    }
+    else{
+        auto cache = SegmentCache::instance();
+        if(!held_segment.isEmpty() && held_segment != edge_key){
+            cache->hold(held_segment,false);
+            held_segment.clear();
+        }
+        if(ahead >= buffer_window && !edge_key.isEmpty()){
+            cache->hold(edge_key,true);
+            held_segment = edge_key;
+        }
+        else if(ahead < buffer_window / 2 && !held_segment.isEmpty()){
+            cache->hold(held_segment,false);
+            held_segment.clear();
+        }
+    }
+    if(!resource->single_video && next_caching){
+        monitor.checkPrefetch(_segmentEnd() - position());
+    }
+    if(!resource->single_video && manager != nullptr && !loads_canceled){
+        _prefetchSegments();
+    }
+    if(!resource->single_video && cur_segment < resource->segments.size() - 1){
+        if(next_caching && ahead >= buffer_window){
+            //Full, pause fetching
+            _stopCaching();
+        }
+        else if(!next_caching && !next_cached && ahead < buffer_window / 2){
+            //Low watermark,resume fetching
+            _beginCaching();
+        }
+    }
+    //Only report when it changed at least 1s
+    if(buffer_ahead < 0 || qAbs(ahead - buffer_ahead) >= 1000){
+        buffer_ahead = ahead;
+        emit bufferLevelChanged(ahead,buffer_window);
+    }
+}
+//--Segments
+void MediaPlayer::_loadSegment(QMediaPlayer *player,int segment){
+    int slot = player == &player1 ? 0 : 1;
+    auto old = segment_streams[slot];
+    segment_streams[slot] = nullptr;
+
+    if(manager == nullptr || resource->single_video){
+        player->setMedia(resource->videos[segment]);
+    }
+    else{
+        auto cache = SegmentCache::instance();
+        auto request = resource->videos[segment].canonicalRequest();
+        const auto &seg = resource->segments[segment];
+
+        QString path = cache->find(SegmentCache::keyOf(request));
+        QIODevice *source = nullptr;
+        if(!path.isEmpty()){
+            mplayerDebug() << _nameOfPlayer(player) << "Load segment" << segment << "from cache";
+        }
+        else{
+            //Read it while it is downloading into the cache (joins the prefetch of it),
+            //a seek in it is done once it is downloaded
+            source = cache->open(manager,request,this);
+        }
+        if(!seg.key.isEmpty()){
+            if(source == nullptr){
+                auto file = new QFile(path);
+                file->open(QIODevice::ReadOnly);
+                source = file;
+            }
+            source = new DecryptStream(manager,request,seg.key,seg.iv,source,this);
+        }
+
+        if(source == nullptr){
+            player->setMedia(QUrl::fromLocalFile(path));
+        }
+        else{
+            player->setMedia(QMediaContent(),source);
+        }
+        segment_streams[slot] = source;
+    }
+    //The player has dropped it now
+    if(old != nullptr){
+        old->deleteLater();
+    }
+}
+void MediaPlayer::_unloadSegment(QMediaPlayer *player){
+    int slot = player == &player1 ? 0 : 1;
+    player->setMedia(QMediaContent());
+    if(segment_streams[slot] != nullptr){
+        segment_streams[slot]->deleteLater();
+        segment_streams[slot] = nullptr;
+    }
+}
+bool MediaPlayer::_isStreaming(QMediaPlayer *player) const{
+    return segment_streams[player == &player1 ? 0 : 1] != nullptr;
+}
+void MediaPlayer::_segmentReady(const QString &key){
+    if(stream_seek < 0 || resource == nullptr || resource->single_video){
+        return;
+    }
+    if(key != SegmentCache::keyOf(resource->videos[cur_segment].canonicalRequest())){
+        return;
+    }
+    //Reload it from the file,it can seek now
+    qint64 pos = stream_seek;
+    stream_seek = -1;
+    bool playing = currentPlayer->state() == QMediaPlayer::PlayingState;
+    currentPlayer->stop();
+    _loadSegment(currentPlayer,cur_segment);
+    currentPlayer->setPosition(pos);
+    currentPlayer->play();
+    if(!playing){
+        currentPlayer->pause();
+    }
+}
+void MediaPlayer::_prefetchSegments(){
+    //The current one and the segments start in the window,
+    //so a rewind into any of them is served from the cache
+    qint64 end = position() + buffer_window;
+    QList<QNetworkRequest> requests;
+    for(int i = cur_segment;i < resource->segments.size() && resource->segments[i].start < end;i++){
+        requests.push_back(resource->videos[i].canonicalRequest());
+    }
+    SegmentCache::instance()->prefetch(manager,requests);
+}
+//--Flv seeking
+void MediaPlayer::setNetworkManager(QNetworkAccessManager *m){
+    manager = m;
+}
+void MediaPlayer::_resetFlv(){
+    if(flv_stream != nullptr){
+        flv_stream->deleteLater();
+        flv_stream = nullptr;
+    }
+    stream_offset = 0;
+    stream_duration = -1;
+}
+bool MediaPlayer::_isFlv() const{
+    return resource->single_video && manager != nullptr && resource->videos[0].canonicalUrl().path().endsWith(".flv");
+}
+void MediaPlayer::_playFlv(const FlvIndex::Keyframe &key){
+    auto stream = new FlvStream(manager,resource->videos[0].canonicalRequest(),key,this);
+    currentPlayer->stop();
+    currentPlayer->setMedia(QMediaContent(),stream);
+    if(flv_stream != nullptr){
+        flv_stream->deleteLater();
+    }
+    flv_stream = stream;
+    stream_offset = key.time;
+    clock.reset(key.time);
+}
+bool MediaPlayer::_seekFlv(qint64 pos){
+    if(manager == nullptr){
+        return false;
+    }
+    auto request = resource->videos[0].canonicalRequest();
+    auto index = FlvIndexCache::instance()->find(request.url());
+    FlvIndex::Keyframe key;
+    if(index.isNull() || !index->find(pos,&key)){
+        return false;
+    }
+    qint64 current = position();
+    if(pos > current && key.time <= current){
+        //The keyframes are sparse,a short forward seek would go back,take the next one
+        if(!index->findAfter(pos,&key)){
+            return false;
+        }
+    }
+    //Play from the keyframe,the clock and the position report where we landed
+    mplayerDebug() << "Flv seek to" << pos << "landed on keyframe" << key.time << "at" << key.position;
+
+    bool playing = currentPlayer->state() == QMediaPlayer::PlayingState;
+    if(stream_duration < 0 && currentPlayer->duration() > 0){
+        stream_duration = currentPlayer->duration();
+    }
+    //Play from the keyframe by a range request
+    _playFlv(key);
+
+    currentPlayer->play();
+    if(!playing){
+        currentPlayer->pause();
+    }
+    return true;
+}
+//--Failover
+void MediaPlayer::_failover(int segment){
+    if(manager == nullptr || !probes.isEmpty() || segment >= resource->backups.size()){
+        return;
+    }
+    if(resource->backups[segment].isEmpty()){
+        mplayerDebug() << "No mirror for segment" << segment;
+        return;
+    }
+    //The current host is starving us,race the mirrors by downloading a chunk,
+    //switch to whichever delivers it first
+    const auto &candidates = resource->backups[segment];
+    mplayerDebug() << "Failover segment" << segment << "racing" << candidates.size() << "mirrors";
+
+    int generation = media_generation;
+    for(const auto &content : candidates){
+        QNetworkRequest request = content.canonicalRequest();
+        request.setRawHeader("Range","bytes=0-" + QByteArray::number(PLAYER_FAILOVER_PROBE - 1));
+        NetworkScheduler::setStage(request,"failover probe");
+        auto reply = NetworkScheduler::instance()->get(manager,request,NetworkScheduler::Playback);
+        probes.push_back(reply);
+        connect(reply,&QNetworkReply::readyRead,this,[reply](){
+            //Only the time matters
+            reply->readAll();
+        });
+        connect(reply,&QNetworkReply::finished,this,[this,reply,content,segment,generation](){
+            reply->deleteLater();
+            if(generation != media_generation || !probes.contains(reply)){
+                //Lost the race,or the media changed
+                return;
+            }
+            probes.removeOne(reply);
+            if(reply->error()){
+                return;
+            }
+            //The winner,abort others
+            _abortProbes();
+            _switchMirror(segment,content);
+        });
+    }
+}
+void MediaPlayer::_abortProbes(){
+    auto replies = probes;
+    probes.clear();
+    for(auto r : replies){
+        r->abort();
+    }
+}
+void MediaPlayer::_switchMirror(int segment,const QMediaContent &content){
+    if(content == resource->videos[segment]){
+        mplayerDebug() << "Current mirror is the fastest";
+        return;
+    }
+    mplayerDebug() << "Switch segment" << segment << "to" << content.canonicalUrl().host();
+    auto cache = SegmentCache::instance();
+    QUrl old_url = resource->videos[segment].canonicalUrl();
+    QString old_key = SegmentCache::keyOf(resource->videos[segment].canonicalRequest());
+    //Swap it with the mirror
+    resource->backups[segment].removeOne(content);
+    resource->backups[segment].push_back(resource->videos[segment]);
+    resource->videos[segment] = content;
+
+    if(size_t(segment) != cur_segment){
+        if(!resource->single_video && !cache->contains(old_key)){
+            //The slow download is useless now,the prefetch takes the mirror
+            if(size_t(segment) == cur_segment + 1 && (next_caching || next_paused)){
+                //Restart caching from the mirror
+                _stopCaching(true);
+                cache->cancel(old_key);
+                _beginCaching();
+            }
+            else{
+                cache->cancel(old_key);
+            }
+        }
+        return;
+    }
+    qint64 pos = position();
+    if(flv_stream != nullptr){
+        //The mirror serves the same file,the keyframes are at the same bytes
+        FlvIndexCache::instance()->alias(old_url,content.canonicalUrl());
+        if(_seekFlv(pos)){
+            return;
+        }
+    }
+    //Reload at the current position
+    bool playing = currentPlayer->state() == QMediaPlayer::PlayingState;
+    if(!resource->single_video){
+        cache->cancel(old_key);
+        pos -= resource->segments[segment].start;
+    }
+    currentPlayer->stop();
+    _loadSegment(currentPlayer,segment);
+    _resetFlv();
+    currentPlayer->setPosition(pos);
+    stream_seek = -1;
+    if(_isStreaming(currentPlayer) && pos > 0){
+        //Ignored by the stream,do it once downloaded
+        stream_seek = pos;
+    }
+    currentPlayer->play();
+    if(!playing){
+        currentPlayer->pause();
+    }
+}
+void MediaPlayer::timerEvent(QTimerEvent *event){
+    if(event->timerId() != buffer_timer){
+        QObject::timerEvent(event);
+        return;
+    }
+    _updateBuffer();
+}
+
+
+//--SeekScheduler
+SeekScheduler::SeekScheduler(QObject *parent) : QObject(parent){
+    timer.setSingleShot(true);
+    timer.setInterval(PLAYER_SEEK_DELAY);
+    connect(&timer,&QTimer::timeout,this,&SeekScheduler::commit);
+}
+void SeekScheduler::request(qint64 position,qint64 duration){
+    if(!timer.isActive()){
+        coalesced = 0;
+        emit burstStarted();
+    }
+    else{
+        coalesced += 1;
+    }
+    if(duration > 0){
+        position = qMin(position,duration);
+    }
+    pending_target = qMax<qint64>(position,0);
+    //Restart the quiet period
+    timer.start();
+    emit targetChanged(pending_target);
+}
+void SeekScheduler::cancel(){
+    timer.stop();
+}
+void SeekScheduler::commit(){
+    playerDebug() << "Commit seek to" << pending_target << "coalesced" << coalesced << "requests";
+    emit committed(pending_target);
+}
 
 Player::Player(QWidget *parent) : QGraphicsView(parent){
     //Configure
@@ -307,6 +950,10 @@ Player::Player(QWidget *parent) : QGraphicsView(parent){
     connect(&player,&MediaPlayer::positionChanged,this,&Player::positionChanged);
     connect(&player,&MediaPlayer::stateChanged,this,&Player::stateChanged);
     connect(&player,&MediaPlayer::nativeSizeChanged,this,&Player::nativeSizeChanged);
+    //Seeking
+    connect(&seeker,&SeekScheduler::burstStarted,&player,&MediaPlayer::cancelLoading);
+    connect(&seeker,&SeekScheduler::targetChanged,this,&Player::seekTargetChanged);
+    connect(&seeker,&SeekScheduler::committed,this,&Player::commitSeek);
 
     //Step up control 
 }
@@ -333,6 +980,11 @@ void Player::positionChanged(qint64 pos){
         danmakuSeek(pos);
     }
 }
+void Player::commitSeek(qint64 pos){
+    danmakuSeek(pos);
+    player.setPosition(pos);
+    qDeleteAll(danmaku_group->childItems());
+}
 void Player::stateChanged(QMediaPlayer::State s){
     if(!danmaku_started){
         return;
@@ -491,7 +1143,7 @@ void Player::danmakuPlay(){
     //ready
     danmaku_started = true;
 
-    danmakuSeek(player.position());
+    danmakuSeek(player.mediaClock()->time());
 
     //Config timer and start
     danmaku_timer = startTimer(
@@ -558,7 +1210,7 @@ void Player::timerEvent(QTimerEvent *event){
     }
 
     //Add danmaku and translate
-    qreal cur_time = player.position() / 1000.0;
+    qreal cur_time = player.mediaClock()->time() / 1000.0;
     QSizeF s = size();//< Current screen size
 
     while(danmaku_iter != danmaku_list.cend() && danmaku_iter->position < cur_time){
@@ -7,10 +7,20 @@
 
 #include <QTextCodec>
 #include <QInputDialog>
+#include <QSettings>
+#include <QTimer>
+#include <QSharedPointer>
+#include <algorithm>
+#include <functional>
+#include <charconv>
 
 #define LXML_NO_EXCEPTIONS
+#define LXML_QT
 
 #include "common/providers.hpp"
+#include "common/cache.hpp"
+#include "common/m3u8.hpp"
+#include "common/scheduler.hpp"
 #include "libs/lxml.hpp"
 
 #include <libxml/HTMLparser.h>
@@ -22,7 +32,204 @@ PLAYER_NS_BEGIN
 
 //Shit code :( Need to be refactored
 
+//XPath expressions of the pages,compiled once in the LXml::XPathRegistry
+namespace XPaths {
+    constexpr const char *AngelSearch = R"(//div[@class="intro"]/h6/a)";
+    constexpr const char *AngelEpisodes = R"(//div[@class="bfdz"]/ul/ul/li/ul/li/a)";
+    constexpr const char *YsjdmSearch = R"(//li[@class="searchlist_item"]/div/a)";
+    constexpr const char *YsjdmEpisodes = R"(//div[@class="playlist_full"]/ul/li/a)";
+    constexpr const char *YsjdmScripts = R"(//script[@type="text/javascript"])";
+    //Checked on each closed element while the page is downloading
+    constexpr const char *YsjdmPlaylistDone = R"(self::div[@class="playlist_full"])";
+    constexpr const char *YsjdmPlayerDone = R"(self::script[starts-with(.,"var player_aaaa=")])";
+}
+void PreloadXPaths(){
+    LXml::XPathRegistry::Instance().preload({
+        XPaths::AngelSearch,
+        XPaths::AngelEpisodes,
+        XPaths::YsjdmSearch,
+        XPaths::YsjdmEpisodes,
+        XPaths::YsjdmScripts,
+        XPaths::YsjdmPlaylistDone,
+        XPaths::YsjdmPlayerDone
+    });
+}
+QString XPathStats(){
+    QString text;
+    for(const auto &stat : LXml::XPathRegistry::Instance().stats()){
+        text += QString("%1\n    %2 次, 平均 %3 us\n")
+            .arg(stat.source)
+            .arg(stat.count)
+            .arg(stat.count > 0 ? stat.nanoseconds / stat.count / 1000 : 0);
+    }
+    return text;
+}
+static LXml::XPathObject XPath(const LXml::HtmlDocument &doc,const char *expr){
+    return LXml::XPathRegistry::Instance().eval(doc.root_node(),expr);
+}
+/**
+ * @brief View the content of the node,the buffer is used only if it is not a plain text
+ * 
+ */
+static std::string_view ContentOf(LXml::NodeRef node,LXml::lstring *buffer){
+    auto view = node.content_view();
+    if(view.empty()){
+        *buffer = node.content_lstring();
+        view = buffer->view();
+    }
+    return view;
+}
+/**
+ * @brief Get the number of "第12集"
+ * 
+ * @return -1 if it is not a episode
+ */
+static int EpisodeOf(std::string_view title){
+    constexpr std::string_view prefix = "第";
+    if(title.compare(0,prefix.size(),prefix) != 0){
+        return -1;
+    }
+    int number = 0;
+    std::from_chars(title.data() + prefix.size(),title.data() + title.size(),number);
+    return number;
+}
+/**
+ * @brief Get the number of the bilibili episode,the key of the matched pages
+ * 
+ * @return -1 if the title is not a number (SP / PV / OVA),they are not on the page
+ */
+static int EpisodeOf(const EpisodeInfo &ep){
+    bool ok = false;
+    int number = ep.title.toInt(&ok);
+    return ok ? number : -1;
+}
+
+/**
+ * @brief Parse the bytes of a reply,libxml2 decodes them once from the charset of the page
+ * 
+ */
+static LXml::HtmlDocument ParseHtml(const QByteArray &data){
+    auto codec = QTextCodec::codecForHtml(data,QTextCodec::codecForName("UTF-8"));
+    return LXml::HtmlDocument::Parse(data.constData(),data.size(),codec->name().constData());
+}
+/**
+ * @brief Parse the page while it is downloading,done is called once an element matching the expression
+ *        is parsed (the rest of the page is not parsed),or on the reply finished,
+ *        the reply is deleted by it when finished
+ * 
+ * @param provider The one sent the reply,the data is read from its body
+ * @param expr Relative to each closed element,like self::div[@class="x"]
+ */
+static void StreamHtml(QNetworkReply *reply,VideoProvider *provider,const char *expr,std::function<void(QNetworkReply*,LXml::HtmlDocument &)> done){
+    struct State {
+        LXml::PushParser parser;
+        int offset = 0;//< Bytes of the body fed
+        bool done = false;
+    };
+    auto state = QSharedPointer<State>::create();
+    state->parser.watch(expr);
+
+    //The reply may be joined by others,feed from the shared body
+    auto feed = [reply,provider,state](){
+        auto data = provider->body(reply);
+        state->parser.feed(data.constData() + state->offset,data.size() - state->offset);
+        state->offset = data.size();
+    };
+    QObject::connect(reply,&QNetworkReply::readyRead,provider,[reply,state,expr,done,feed](){
+        if(reply->attribute(QNetworkRequest::HttpStatusCodeAttribute).toInt() != 200){
+            //Leave the error page to the finished handler
+            return;
+        }
+        if(state->done){
+            //Keep downloading,so the page is stored in the disk cache
+            return;
+        }
+        feed();
+        if(!state->parser.seen()){
+            return;
+        }
+        providerDebug() << "Got" << expr << "skip the rest of" << reply->url();
+        state->done = true;
+        auto doc = state->parser.finish();
+        done(reply,doc);
+    });
+    QObject::connect(reply,&QNetworkReply::finished,provider,[reply,state,done,feed](){
+        //It lives until the whole page is in the cache
+        reply->deleteLater();
+        if(state->done){
+            return;
+        }
+        state->done = true;
+        feed();
+        auto doc = state->parser.finish();
+        done(reply,doc);
+    });
+}
+
 //--Video Provider
+void VideoProvider::cancelPending(){
+    current_generation += 1;
+    //Drop them from the table first,so a new fetch of the same url is not joined to an aborted one
+    auto keys = inflight.keys();
+    for(const auto &key : keys){
+        auto reply = inflight.value(key);
+        if(reply->property("generation").toULongLong() != 0){
+            providerDebug() << "Cancel" << reply->url();
+            inflight.remove(key);
+            reply->abort();
+        }
+    }
+}
+QNetworkReply *VideoProvider::get(const QNetworkRequest &request,bool cancelable){
+    QByteArray key = "GET " + request.url().toEncoded();
+    if(inflight.contains(key)){
+        return join(key,cancelable);
+    }
+    return track(NetworkScheduler::instance()->get(manager,request,NetworkScheduler::Metadata),key,cancelable);
+}
+QNetworkReply *VideoProvider::post(const QNetworkRequest &request,const QByteArray &data,bool cancelable){
+    QByteArray key = "POST " + request.url().toEncoded() + " " + data;
+    if(inflight.contains(key)){
+        return join(key,cancelable);
+    }
+    return track(NetworkScheduler::instance()->post(manager,request,data,NetworkScheduler::Metadata),key,cancelable);
+}
+QNetworkReply *VideoProvider::track(QNetworkReply *reply,const QByteArray &key,bool cancelable){
+    //Generation 0 is never stale
+    reply->setProperty("generation",cancelable ? current_generation : quint64(0));
+    inflight.insert(key,reply);
+    //Connected before the callers,so the data is kept for all of them
+    connect(reply,&QNetworkReply::readyRead,this,[this,reply](){
+        bodies[reply] += reply->readAll();
+    });
+    connect(reply,&QNetworkReply::finished,this,[this,reply,key](){
+        bodies[reply] += reply->readAll();
+        if(inflight.value(key) == reply){
+            inflight.remove(key);
+        }
+    });
+    connect(reply,&QObject::destroyed,this,[this,reply](){
+        bodies.remove(reply);
+    });
+    return reply;
+}
+QNetworkReply *VideoProvider::join(const QByteArray &key,bool cancelable){
+    auto reply = inflight.value(key);
+    providerDebug() << "Join the request in flight" << reply->url();
+    if(!cancelable){
+        //Someone else needs it,keep it on cancelPending
+        reply->setProperty("generation",quint64(0));
+    }
+    return reply;
+}
+bool VideoProvider::isStale(QNetworkReply *reply) const{
+    quint64 gen = reply->property("generation").toULongLong();
+    if(gen == 0){
+        return false;
+    }
+    return gen != current_generation || reply->error() == QNetworkReply::OperationCanceledError;
+}
+
 void BilibiliProvider::fetchVideo(const SeasonInfo &info,int n,QStringView resolution){
     const auto &episode = info.episodes[n];
 
@@ -32,29 +239,24 @@ void BilibiliProvider::fetchVideo(const SeasonInfo &info,int n,QStringView resol
     }
 
     //Get video url from bilibili
-    QUrl url("https://api.bilibili.com/x/player/playurl?avid=" + QString::number(episode.aid) 
-        + "&cid=" + QString::number(episode.cid) 
-        + "&qn=" + resolution.toString() 
-    );
-
-    QNetworkRequest request;
-    request.setUrl(url);
-    request.setRawHeader("User-Agent",PLAYER_USERAGENT);
-    request.setRawHeader("Referer",PLAYER_BILIREFERER);
-
-    //Send it
-    auto reply = manager->get(request);
-
-    connect(reply,&QNetworkReply::finished,[this,reply](){
+    QNetworkRequest request = playurlRequest(episode,resolution.toString());
+
+    //Send it,or use the cached one
+    auto key = PlayurlCache::keyOf(name(),episode.aid,episode.cid,resolution.toString());
+    auto gen = generation();
+    PlayurlCache::instance()->get(manager,key,request,this,[this,gen](const QByteArray &body,const QString &err){
+        if(gen != generation()){
+            //Canceled
+            return;
+        }
         //Check the reply
-        reply->deleteLater();
-        if(reply->error()){
-            providerDebug() << "Error:" << reply->errorString();
-            emit error(reply->errorString());
+        if(!err.isEmpty()){
+            providerDebug() << "Error:" << err;
+            emit error(err);
             return;
         }
         //Parse json 
-        QJsonDocument json_doc = QJsonDocument::fromJson(reply->readAll());
+        QJsonDocument json_doc = QJsonDocument::fromJson(body);
         if(json_doc.isNull()){
             providerDebug() << "Error: Invalid JSON";
             emit error("Invalid JSON");
@@ -86,6 +288,15 @@ void BilibiliProvider::fetchVideo(const SeasonInfo &info,int n,QStringView resol
             request2.setRawHeader("Referer",PLAYER_BILIREFERER);
 
             res.videos.push_back(QMediaContent(request2));
+
+            //Mirrors for failover
+            QList<QMediaContent> backups;
+            for(auto backup : item.toObject()["backup_url"].toArray()){
+                QNetworkRequest request3(request2);
+                request3.setUrl(backup.toString());
+                backups.push_back(QMediaContent(request3));
+            }
+            res.backups.push_back(backups);
         }
         
         res.duration = -1;
@@ -103,23 +314,22 @@ void BilibiliProvider::fetchInfo(const SeasonInfo &info,int n){
     }
 
     //Get video url from bilibili
-    QUrl url("https://api.bilibili.com/x/player/playurl?avid=" + QString::number(episode.aid) + "&cid=" + QString::number(episode.cid));
-    QNetworkRequest request;
-    request.setUrl(url);
-    request.setRawHeader("User-Agent",PLAYER_USERAGENT);
-    request.setRawHeader("Referer",PLAYER_BILIREFERER);
-
-    //Send it
-    auto reply = manager->get(request);
-    
-    connect(reply,&QNetworkReply::finished,[reply,this](){
-        reply->deleteLater();
-        if(reply->error()){
-            emit error(reply->errorString());
+    QNetworkRequest request = playurlRequest(episode,QString());
+
+    //Send it,or use the cached one
+    auto key = PlayurlCache::keyOf(name(),episode.aid,episode.cid,QString());
+    auto gen = infoGeneration();
+    PlayurlCache::instance()->get(manager,key,request,this,[this,gen](const QByteArray &body,const QString &err){
+        if(gen != infoGeneration()){
+            //Canceled
+            return;
+        }
+        if(!err.isEmpty()){
+            emit error(err);
             return;
         }
         //Parse json
-        QJsonDocument json_doc = QJsonDocument::fromJson(reply->readAll());
+        QJsonDocument json_doc = QJsonDocument::fromJson(body);
         if(json_doc.isNull()){
             emit error("Invalid JSON");
             return;
@@ -146,6 +356,29 @@ void BilibiliProvider::fetchInfo(const SeasonInfo &info,int n){
     });
 }
 
+QNetworkRequest BilibiliProvider::playurlRequest(const EpisodeInfo &episode,const QString &qn){
+    QString url = "https://api.bilibili.com/x/player/playurl?avid=" + QString::number(episode.aid) + "&cid=" + QString::number(episode.cid);
+    if(!qn.isEmpty()){
+        url += "&qn=" + qn;
+    }
+    QNetworkRequest request;
+    request.setUrl(QUrl(url));
+    request.setRawHeader("User-Agent",PLAYER_USERAGENT);
+    request.setRawHeader("Referer",PLAYER_BILIREFERER);
+    NetworkScheduler::setStage(request,"playurl");
+    return request;
+}
+QString BilibiliProvider::defaultResolution(const QByteArray &body){
+    QJsonDocument json_doc = QJsonDocument::fromJson(body);
+    for(auto item : json_doc["data"]["accept_quality"].toArray()){
+        //Same as fetchInfo
+        if(item.toInt() <= 64){
+            return QString::number(item.toInt());
+        }
+    }
+    return QString();
+}
+
 void LocalProvider::fetchInfo(const SeasonInfo &,int){
     //We didnot need to get info 
     VideoInfo info;
@@ -218,81 +451,60 @@ void AngelProvider::matchVideoPages(const QString &_name){
     request.setRawHeader("User-Agent",PLAYER_USERAGENT);
     request.setRawHeader("Referer",search_url.toUtf8());
 
-    auto reply = manager->post(request,data);
+    auto reply = post(request,data,false);
     //Connect the reply
     connect(reply,&QNetworkReply::finished,[this,reply](){
-        const auto &data = reply->readAll();
+        const auto &data = body(reply);
         reply->deleteLater();
+        if(isStale(reply)){
+            return;
+        }
         if(reply->error()){
             emit error(reply->errorString());
             return;
         }
-        auto codec = QTextCodec::codecForHtml(data);
-        auto html = codec->toUnicode(data);
-        providerDebug() << html;
+        providerDebug() << "Search page" << data.size() << "bytes";
 
         //Save the html
         // QFile file("/tmp/angel.html");0
         // file.open(QIODevice::WriteOnly);
         // file.write(data);
 
-        //XPath expression to get the video url
-        const auto xpath = R"(//div[@class="intro"]/h6/a)";
-        //Using libxml2
-        auto doc = htmlReadDoc(BAD_CAST html.toStdString().c_str(),nullptr,"utf8",
-            XML_PARSE_NOBLANKS | XML_PARSE_NONET | XML_PARSE_NOERROR | XML_PARSE_NOWARNING
-        );
-        if(doc == nullptr){
-            emit error("Invalid HTML");
-        }
-        //Compile xpath
-        auto xpath_obj = xmlXPathNewContext(doc);
-        auto xpath_res = xmlXPathEvalExpression(BAD_CAST xpath,xpath_obj);
-        xmlXPathFreeContext(xpath_obj);
-        if(xpath_res == nullptr){
-            xmlFreeDoc(doc);
+        auto doc = ParseHtml(data);
+        auto nodes = XPath(doc,XPaths::AngelSearch);
+        if(nodes.is_null()){
             emit error("Invalid XPath");
             return;
         }
         //Get the result
-        if(xmlXPathNodeSetIsEmpty(xpath_res->nodesetval)){
-            xmlXPathFreeObject(xpath_res);
-            xmlFreeDoc(doc);
+        if(nodes.as_nodeset().size() == 0){
             emit error("Search : No result");
             return;
         }
-        //For node
-        xmlNodeSetPtr nodeset = xpath_res->nodesetval;
 
         QList<QPair<QString,QString>> results;
-
-        for(int n = 0;n < nodeset->nodeNr;n ++){
-            auto node = nodeset->nodeTab[n];
+        for(auto node : nodes){
             //Get attribute herf
-            auto url = xmlGetProp(node,BAD_CAST "href");
-            auto url_str = QString::fromUtf8((char*)url);
-            xmlFree(url);
-
-            //Get children
-            auto child = xmlGetLastChild(node);
-            QString name;
+            QString url_str = LXml::ToQString(node.attribute_view("href"));
             //Get the alt
-            if(child != nullptr){
-                auto alt = xmlNodeGetContent(child);
-                auto alt_str = QString::fromUtf8((char*)alt);
-                name = alt_str;
-                xmlFree(alt);
+            QString name;
+            LXml::NodeRef child(xmlGetLastChild(node.get()));
+            if(!child.is_null()){
+                LXml::lstring buffer;
+                name = LXml::ToQString(ContentOf(child,&buffer));
             }
             //Push to list
             results.push_back(QPair<QString,QString>(name,url_str));
         }
-        //Free it
-        xmlXPathFreeObject(xpath_res);
-        xmlFreeDoc(doc);
 
         providerDebug() << results;
         QString url_of;
 
+        if(results.size() > 1 && !interactive){
+            //Running in background,do not block the ui
+            emit error("Search : Ambiguous result");
+            return;
+        }
         if(results.size() > 1){
             //Show the dialog,let user choose
             QInputDialog dialog;
@@ -323,92 +535,64 @@ void AngelProvider::matchVideoPages(const QString &_name){
         url_of.prepend(url_prefix);
 
         //Make a new request of it :(
-        QNetworkRequest request;
-        request.setUrl(QUrl(url_of));
-        request.setRawHeader("User-Agent",PLAYER_USERAGENT);
-        request.setRawHeader("Referer",url_of.toUtf8());
+        fetchVideoPages(url_of);
+    });
+}
+void AngelProvider::fetchVideoPages(const QString &url){
+    QNetworkRequest request;
+    request.setUrl(QUrl(url));
+    request.setRawHeader("User-Agent",PLAYER_USERAGENT);
+    request.setRawHeader("Referer",url.toUtf8());
 
-        auto rpl = manager->get(request);
-        connect(rpl,&QNetworkReply::finished,[rpl,this](){
-            videoPagesReady(rpl);
-        });
+    auto rpl = get(request,false);
+    connect(rpl,&QNetworkReply::finished,[rpl,this](){
+        videoPagesReady(rpl);
     });
 }
 //--Handle receive video pages
 void AngelProvider::videoPagesReady(QNetworkReply *reply){
     reply->deleteLater();
+    if(isStale(reply)){
+        return;
+    }
     if(reply->error()){
         emit error(reply->errorString());
         return;
     }
     //Get the data
-    const auto &data = reply->readAll();
-    //Todo:Parse detail page
-    auto codec = QTextCodec::codecForHtml(data);
-    auto html = codec->toUnicode(data);
-
-    const auto xpath = R"(//div[@class="bfdz"]/ul/ul/li/ul/li/a)";
-    auto doc = htmlReadDoc(BAD_CAST html.toStdString().c_str(),nullptr,"utf8",
-        XML_PARSE_NOBLANKS | XML_PARSE_NONET | XML_PARSE_NOERROR | XML_PARSE_NOWARNING
-    );
-    if(doc == nullptr){
-        emit error("Invalid HTML");
-    }
-    //Compile xpath
-    auto xpath_obj = xmlXPathNewContext(doc);
-    auto xpath_res = xmlXPathEvalExpression(BAD_CAST xpath,xpath_obj);
-    xmlXPathFreeContext(xpath_obj);
-    if(xpath_res == nullptr){
-        xmlFreeDoc(doc);
+    const auto &data = body(reply);
+    auto doc = ParseHtml(data);
+    auto nodes = XPath(doc,XPaths::AngelEpisodes);
+    if(nodes.is_null()){
         emit error("Invalid XPath");
         return;
     }
     //Get the result
-    if(xmlXPathNodeSetIsEmpty(xpath_res->nodesetval)){
-        xmlXPathFreeObject(xpath_res);
-        xmlFreeDoc(doc);
+    if(nodes.as_nodeset().size() == 0){
         emit error("VideoPage : No result");
         return;
     }
-    //For node
-    xmlNodeSetPtr nodeset = xpath_res->nodesetval;
-    for(int n = 0;n < nodeset->nodeNr;n ++){
-        auto node = nodeset->nodeTab[n];
-
-        //Get title / href prop
-        auto title = xmlGetProp(node,BAD_CAST "title");
-        auto href = xmlGetProp(node,BAD_CAST "href");
-
-        //To QString
-        auto title_str = QString::fromUtf8((char*)title);
-        auto href_str = QString::fromUtf8((char*)href);
-
-        //Free it
-        xmlFree(title);
-        xmlFree(href);
+    for(auto node : nodes){
+        //Get title / href prop,view them in the document
+        auto title = node.attribute_view("title");
+        auto href = node.attribute_view("href");
 
         //Check href is begin with '/'
-        if(!href_str.startsWith("/")){
+        if(href.empty() || href[0] != '/'){
             continue;
         }
-        //Cehck title_str is begin with '第'
-        if(!title_str.startsWith("第")){
+        //The string is 第numberString
+        int number = EpisodeOf(title);
+        if(number < 0){
             continue;
         }
-        //The string is 第numberString
-        //Get number
-        auto number_str = title_str.mid(1).toStdString();
-
-        int number = std::atoi(number_str.c_str());
-
-        providerDebug () << number << title_str << href_str;
-
-        video_pages[number] = url_prefix + href_str;
+        video_pages[number] = url_prefix + LXml::ToQString(href);
     }
     providerDebug() << video_pages;
 
-    //OK Done
+    //OK Done,remember it for the next time
     matched = true;
+    saveMatch(season_id,reply->request().url().toString(),video_pages);
 
     //Create an empty to notify the player
     VideoInfo info;
@@ -419,8 +603,19 @@ void AngelProvider::videoPagesReady(QNetworkReply *reply){
 }
 
 void AngelProvider::fetchInfo(const SeasonInfo &season,int idx){
-    const auto &episode = season.episodes[idx];
-
+    if(!matched){
+        //Matched by another window / in the previous sessions
+        season_id = season.season_id;
+        QString page;
+        if(findMatch(season_id,&page,&video_pages)){
+            matched = true;
+        }
+        else if(!page.isEmpty()){
+            //Skip the search,fetch the page again
+            fetchVideoPages(page);
+            return;
+        }
+    }
     if(matched){
         //Create an empty to notify the player
         VideoInfo info;
@@ -440,16 +635,25 @@ void AngelProvider::fetchVideo(const SeasonInfo &season,int n,QStringView){
     //Begin fetch video by info
     if(!matched){
         emit error("Still wating for matched video page");
+        return;
     }
     //real idx
-    int idx = season.episodes[n].title.toInt();
-    
-    //Get the url
     auto &ep = season.episodes[n];
+    int idx = EpisodeOf(ep);
+    if(idx < 0){
+        //Not a numbered one,the match is still good
+        emit error("No video page for " + ep.title);
+        return;
+    }
+
+    //Get the url
     providerDebug() << "Fetch video For : " << ep.title;
 
-    auto url_iter = video_pages.find(ep.title.toInt());
+    auto url_iter = video_pages.find(idx);
     if(url_iter == video_pages.end()){
+        //Maybe a new episode,fetch the page again on the next fetchInfo
+        matched = false;
+        dropMatch(season.season_id);
         emit error("No video page found");
         return;
     }
@@ -462,16 +666,19 @@ void AngelProvider::fetchVideo(const SeasonInfo &season,int n,QStringView){
     request.setRawHeader("User-Agent",PLAYER_USERAGENT);
     request.setRawHeader("Referer",search_url.toUtf8());
 
-    auto rpl = manager->get(request);
+    auto rpl = get(request);
     connect(rpl,&QNetworkReply::finished,[rpl,url,idx,this](){
         //Process here
         rpl->deleteLater();
+        if(isStale(rpl)){
+            return;
+        }
         if(rpl->error()){
             emit error(rpl->errorString());
             return;
         }
         //Get the data
-        const auto &data = rpl->readAll();
+        const auto &data = body(rpl);
         auto codec = QTextCodec::codecForHtml(data);
         auto html = codec->toUnicode(data);
 
@@ -495,7 +702,7 @@ void AngelProvider::fetchVideo(const SeasonInfo &season,int n,QStringView){
         request.setRawHeader("User-Agent",PLAYER_USERAGENT);
         request.setRawHeader("Referer",url.toUtf8());
 
-        auto reply = manager->get(request);
+        auto reply = get(request);
         connect(reply,&QNetworkReply::finished,[reply,this,idx](){
             videoJsReady(reply,idx);
         });
@@ -504,12 +711,15 @@ void AngelProvider::fetchVideo(const SeasonInfo &season,int n,QStringView){
 void AngelProvider::videoJsReady(QNetworkReply *reply,int idx){
     //Process here
     reply->deleteLater();
+    if(isStale(reply)){
+        return;
+    }
     if(reply->error()){
         emit error(reply->errorString());
         return;
     }
     //Get the data
-    const auto &data = reply->readAll();
+    const auto &data = body(reply);
     QString js = QString::fromUtf8(data);
     //Match stirng like https://yun.66dm.net/xxx/xxx.m3u8
     QRegularExpression re("https://yun.66dm.net/[^/]+/[^/]+\\.m3u8");
@@ -530,101 +740,125 @@ void AngelProvider::videoJsReady(QNetworkReply *reply,int idx){
     providerDebug() << "Video url : " << url;
 
 
+    //Got m3u8
+    fetchM3U8(QUrl(url),reply->url().toString().toUtf8());
+}
+
+void TsdmProvider::fetchM3U8(const QUrl &url,const QByteArray &referer,int depth){
     QNetworkRequest request;
-    request.setUrl(QUrl(url));
+    request.setUrl(url);
     request.setRawHeader("User-Agent",PLAYER_USERAGENT);
-    request.setRawHeader("Referer",reply->url().toString().toUtf8());
+    request.setRawHeader("Referer",referer);
 
-    //Got m3u8
-    auto rpy = manager->get(request);
-    connect(rpy,&QNetworkReply::finished,[rpy,this](){
-        providerDebug() << "Got m3u8";
-        rpy->deleteLater();
-        if(rpy->error()){
-            emit error(rpy->errorString());
+    auto reply = get(request);
+    connect(reply,&QNetworkReply::finished,this,[this,reply,referer,depth](){
+        m3u8Ready(reply,referer,depth);
+    });
+}
+void TsdmProvider::m3u8Ready(QNetworkReply *reply,const QByteArray &referer,int depth){
+    reply->deleteLater();
+    if(isStale(reply)){
+        return;
+    }
+    if(reply->error()){
+        emit error(reply->errorString());
+        return;
+    }
+    //Check status code
+    if(reply->attribute(QNetworkRequest::HttpStatusCodeAttribute).toInt() != 200){
+        emit error("Status code not 200");
+        return;
+    }
+    //Relative uris are from the url after the redirects
+    M3U8Playlist playlist;
+    if(!playlist.parse(body(reply),reply->url())){
+        emit error("Invalid m3u8");
+        return;
+    }
+    if(playlist.isMaster()){
+        if(depth >= PLAYER_M3U8_DEPTH){
+            //A master pointing to itself or nested too deep
+            emit error("Too many nested m3u8");
             return;
         }
-        //Get the data
-        const auto &data = rpy->readAll();
-        QString m3u8 = QString::fromUtf8(data);
-        VideoResource res;
-
-        if(parseEncrypedM3U8(m3u8,res)){
-            emit videoReady(res);
-        }
-    });
+        //Use the best one
+        auto &variant = playlist.variants[playlist.bestVariant()];
+        providerDebug() << "Master playlist,use variant" << variant.bandwidth << variant.resolution << variant.url;
+        fetchM3U8(variant.url,referer,depth + 1);
+        return;
+    }
+    VideoResource res;
+    if(parseEncrypedM3U8(playlist,res)){
+        providerDebug() << "Got video :" << playlist.segments.size() << "segments";
+        emit videoReady(res);
+    }
 }
-
-bool TsdmProvider::parseEncrypedM3U8(const QString &m3u8,VideoResource &res){
-    //Split the m3u8
-    QStringList lines = m3u8.split("\n");
-    //Get the video url
-
-    qreal duration = 0;
-    qreal seg_duration = 0;
-
-    for(auto iter = lines.begin();iter != lines.end();){
-        if(iter->startsWith("#EXTINF:")){
-            //Get the duration
-            QStringList list = iter->split(",");
-            if(list.size() < 2){
-                emit error("No duration found");
+bool TsdmProvider::parseEncrypedM3U8(const M3U8Playlist &playlist,VideoResource &res){
+    if(playlist.segments.isEmpty()){
+        emit error("No segment found");
+        return false;
+    }
+    res.videos.reserve(playlist.segments.size());
+    res.segments.reserve(playlist.segments.size());
+
+    for(const auto &seg : playlist.segments){
+        const M3U8Playlist::Key *key = nullptr;
+        if(seg.key >= 0){
+            key = &playlist.keys[seg.key];
+            if(key->method != "AES-128"){
+                emit error("Unsupported encryption " + QString::fromLatin1(key->method));
                 return false;
             }
-            seg_duration = list[0].mid(8).toDouble();
-            duration += seg_duration;
+        }
 
-            //Find url next
-            ++iter;
-            if(iter == lines.cend()){
-                emit error("No url found");
-                return false;
-            }
-            //Get the url
-            QNetworkRequest request;
-            request.setUrl(QUrl(*iter));
-            request.setRawHeader("User-Agent",PLAYER_USERAGENT);
-            // request.setRawHeader("Referer",rpy->url().toString().toUtf8());
-            //Set range
+        QNetworkRequest request;
+        request.setUrl(seg.url);
+        request.setRawHeader("User-Agent",PLAYER_USERAGENT);
+        if(seg.length >= 0){
+            //Sub range of a file
+            request.setRawHeader("Range","bytes=" + QByteArray::number(seg.offset) + "-" + QByteArray::number(seg.offset + seg.length - 1));
+        }
+        else if(key == nullptr){
+            //Skip the png they put before the real video
             request.setRawHeader("Range","bytes=" + QByteArray::number(offset) + "-");
-            res.videos.push_back(request);
-
-            //Create a segment
-            VideoResource::Segment seg;
-            //Cast to ms
-            seg.duration = seg_duration * 1000;
-            seg.start = (duration - seg_duration) * 1000;
-            res.segments.push_back(seg);
+        }
+        res.videos.push_back(request);
 
-            //
+        VideoResource::Segment s;
+        s.start = seg.start;
+        s.duration = seg.duration;
+        if(key != nullptr){
+            //Decrypted by the player as it downloads
+            s.key = key->uri;
+            s.iv = M3U8Playlist::ivOf(*key,seg.sequence);
         }
-        else{
-            //Skip
-            ++iter;
-        }
-    }
-    res.duration = duration * 1000;
-    // for(auto &url : lines){
-    //     if(url.startsWith("#")){
-    //         continue;
-    //     }
-    //     //Get the url,create the request
-    //     if(url.isEmpty()){
-    //         continue;
-    //     }
-    //     QNetworkRequest request;
-    //     request.setUrl(QUrl(url));
-    //     request.setRawHeader("User-Agent",PLAYER_USERAGENT);
-    //     request.setRawHeader("Referer",rpy->url().toString().toUtf8());
-    //     //Set range
-    //     request.setRawHeader("Range","bytes=" + QByteArray::number(offset) + "-");
-
-    //     res.videos.push_back(request);
-    // }
+        res.segments.push_back(s);
+    }
+    res.duration = playlist.duration;
     res.single_video = false;
     return true;
 }
 
+bool TsdmProvider::findMatch(int season_id,QString *page,QMap<int,QString> *pages) const{
+    if(ProviderRegistry::instance()->findPages(name(),season_id,pages)){
+        return true;
+    }
+    if(!MatchIndex::instance()->find(name(),season_id,page,pages) || pages->isEmpty()){
+        return false;
+    }
+    providerDebug() << "Use matched page" << *page;
+    ProviderRegistry::instance()->setPages(name(),season_id,*pages);
+    return true;
+}
+void TsdmProvider::saveMatch(int season_id,const QString &page,const QMap<int,QString> &pages){
+    ProviderRegistry::instance()->setPages(name(),season_id,pages);
+    MatchIndex::instance()->save(name(),season_id,page,pages);
+}
+void TsdmProvider::dropMatch(int season_id){
+    ProviderRegistry::instance()->dropPages(name(),season_id);
+    MatchIndex::instance()->invalidate(name(),season_id);
+}
+
 void YsjdmProvider::matchVideoPages(const QString &str){
     QUrl url = QUrl(search_url.arg(str));
     QNetworkRequest request;
@@ -632,26 +866,30 @@ void YsjdmProvider::matchVideoPages(const QString &str){
     request.setRawHeader("User-Agent",PLAYER_USERAGENT);
     request.setRawHeader("Referer",url.toString().toUtf8());
 
-    auto reply = manager->get(request);
+    auto reply = get(request,false);
     connect(reply,&QNetworkReply::finished,[reply,this](){
         reply->deleteLater();
+        if(isStale(reply)){
+            return;
+        }
         if(reply->error()){
             emit error(reply->errorString());
             return;
         }
         //Get the data
-        const auto &data = reply->readAll();
-        auto codec = QTextCodec::codecForHtml(data);
-        QString html = codec->toUnicode(data);
-
+        const auto &data = body(reply);
         //Get search result
-        auto doc = LXml::HtmlDocument::Parse(html.toStdString());
-        auto nodes = doc.root_node().xpath(R"(//li[@class="searchlist_item"]/div/a)");
+        auto doc = ParseHtml(data);
+        auto nodes = XPath(doc,XPaths::YsjdmSearch);
+        if(nodes.is_null()){
+            emit error("Invalid HTML");
+            return;
+        }
 
         QList<QPair<QString,QString>> results;
         for(auto node : nodes){
-            QString title = node.attribute("title").c_str();
-            QString url = node.attribute("href").c_str();
+            QString title = LXml::ToQString(node.attribute_view("title"));
+            QString url = LXml::ToQString(node.attribute_view("href"));
             results.push_back(QPair<QString,QString>(title,url));
         }
         providerDebug() << "Search result : " << results;
@@ -662,6 +900,11 @@ void YsjdmProvider::matchVideoPages(const QString &str){
 
         //Check if the result is more than one
         QString url_of;
+        if(results.size() > 1 && !interactive){
+            //Running in background,do not block the ui
+            emit error("Search : Ambiguous result");
+            return;
+        }
         if(results.size() > 1){
             //Show the dialog,let user choose
             QInputDialog dialog;
@@ -692,20 +935,25 @@ void YsjdmProvider::matchVideoPages(const QString &str){
         providerDebug() << "Fetch :" << url_of;
         
         //OK Send it
-        QNetworkRequest request;
-        request.setUrl(QUrl(url_of));
-        request.setRawHeader("User-Agent",PLAYER_USERAGENT);
-        request.setRawHeader("Referer",url_of.toUtf8());
+        fetchVideoPages(url_of);
+    });
+}
+void YsjdmProvider::fetchVideoPages(const QString &url){
+    QNetworkRequest request;
+    request.setUrl(QUrl(url));
+    request.setRawHeader("User-Agent",PLAYER_USERAGENT);
+    request.setRawHeader("Referer",url.toUtf8());
 
-        auto rpy = manager->get(request);
-        connect(rpy,&QNetworkReply::finished,[rpy,this](){
-            videoPagesReady(rpy);
-        });
+    auto rpy = get(request,false);
+    StreamHtml(rpy,this,XPaths::YsjdmPlaylistDone,[this](QNetworkReply *reply,LXml::HtmlDocument &doc){
+        videoPagesReady(reply,doc);
     });
 }
 
-void YsjdmProvider::videoPagesReady(QNetworkReply *reply){
-    reply->deleteLater();
+void YsjdmProvider::videoPagesReady(QNetworkReply *reply,LXml::HtmlDocument &doc){
+    if(isStale(reply)){
+        return;
+    }
 
     if(reply->error()){
         emit error(reply->errorString());
@@ -716,39 +964,33 @@ void YsjdmProvider::videoPagesReady(QNetworkReply *reply){
         emit error("Status code not 200");
         return;
     }
-    //Get the data
-    const auto &data = reply->readAll();
-    auto codec = QTextCodec::codecForHtml(data);
-    QString html = codec->toUnicode(data);
-    
-    auto doc = LXml::HtmlDocument::Parse(html.toStdString());
-    auto nodes = doc.root_node().xpath(R"(//div[@class="playlist_full"]/ul/li/a)");
-    if(nodes.as_nodeset().size() == 0){
+    //Only the first playlist is parsed,keep the first source
+    auto nodes = XPath(doc,XPaths::YsjdmEpisodes);
+    if(nodes.is_null() || nodes.as_nodeset().size() == 0){
         emit error("No video found");
         return;
     }
     for(auto node : nodes){
-        QString title = node.content().c_str();
-        QString url = node.attribute("href").c_str();
-        providerDebug() << title << url;
+        LXml::lstring buffer;
+        auto title = ContentOf(node,&buffer);
+        auto url = node.attribute_view("href");
         //Check href is begin with '/'
-        if(!url.startsWith("/")){
+        if(url.empty() || url[0] != '/'){
             continue;
         }
-        //Cehck title_str is begin with '第'
-        if(!title.startsWith("第")){
+        //The string is 第numberString
+        int number = EpisodeOf(title);
+        if(number < 0){
             continue;
         }
-        //The string is 第numberString
-        //Get number
-        auto number_str = title.mid(1).toStdString();
-        int number = 0;
-        number = std::atoi(number_str.c_str());
         //Insert
-        video_pages.insert(number,url);
+        if(!video_pages.contains(number)){
+            video_pages.insert(number,LXml::ToQString(url));
+        }
     }
     providerDebug() << "Video pages : " << video_pages;
     matched = true;
+    saveMatch(season_id,reply->request().url().toString(),video_pages);
 
     //Create an empty to notify the player
     VideoInfo info;
@@ -758,6 +1000,19 @@ void YsjdmProvider::videoPagesReady(QNetworkReply *reply){
     emit videoInfoReady(info);
 }
 void YsjdmProvider::fetchInfo(const SeasonInfo &season,int idx){
+    if(!matched){
+        //Matched by another window / in the previous sessions
+        season_id = season.season_id;
+        QString page;
+        if(findMatch(season_id,&page,&video_pages)){
+            matched = true;
+        }
+        else if(!page.isEmpty()){
+            //Skip the search,fetch the page again
+            fetchVideoPages(page);
+            return;
+        }
+    }
     if(matched){
         //Create an empty to notify the player
         VideoInfo info;
@@ -780,10 +1035,18 @@ void YsjdmProvider::fetchVideo(const SeasonInfo &season,int n,QStringView){
     }
     //Get the url
     //real idx
-    int idx = season.episodes[n].title.toInt();
+    int idx = EpisodeOf(season.episodes[n]);
+    if(idx < 0){
+        //Not a numbered one,the match is still good
+        emit error("No video page for " + season.episodes[n].title);
+        return;
+    }
     //Try to find the url
     auto it = video_pages.find(idx);
     if(it == video_pages.end()){
+        //Maybe a new episode,fetch the page again on the next fetchInfo
+        matched = false;
+        dropMatch(season.season_id);
         emit error("No video found");
         return;
     }
@@ -796,13 +1059,15 @@ void YsjdmProvider::fetchVideo(const SeasonInfo &season,int n,QStringView){
     request.setRawHeader("User-Agent",PLAYER_USERAGENT);
     request.setRawHeader("Referer",url.toUtf8());
 
-    auto rpy = manager->get(request);
-    connect(rpy,&QNetworkReply::finished,[rpy,this](){
-        videoPageReady(rpy);
+    auto rpy = get(request);
+    StreamHtml(rpy,this,XPaths::YsjdmPlayerDone,[this](QNetworkReply *reply,LXml::HtmlDocument &doc){
+        videoPageReady(reply,doc);
     });
 }
-void YsjdmProvider::videoPageReady(QNetworkReply *reply){
-    reply->deleteLater();
+void YsjdmProvider::videoPageReady(QNetworkReply *reply,LXml::HtmlDocument &doc){
+    if(isStale(reply)){
+        return;
+    }
 
     if(reply->error()){
         emit error(reply->errorString());
@@ -813,25 +1078,20 @@ void YsjdmProvider::videoPageReady(QNetworkReply *reply){
         emit error("Status code not 200");
         return;
     }
-    //Get the data
-    const auto &data = reply->readAll();
-    auto codec = QTextCodec::codecForHtml(data);
-    QString html = codec->toUnicode(data);
-
-    auto doc = LXml::HtmlDocument::Parse(html.toStdString());
     //Use xpath to get all; javascript 
-    auto nodes = doc.root_node().xpath(R"(//script[@type="text/javascript"])");
-    if(nodes.as_nodeset().size() == 0){
+    auto nodes = XPath(doc,XPaths::YsjdmScripts);
+    if(nodes.is_null() || nodes.as_nodeset().size() == 0){
         emit error("No URL found");
         return;
     }
     //Get the url
     QString content;
     for(auto node : nodes){
-        QString js = node.content().c_str();
-        providerDebug() << js;
-        if(js.startsWith("var player_aaaa=")){
-            content = js.mid(16);
+        LXml::lstring buffer;
+        auto js = ContentOf(node,&buffer);
+        constexpr std::string_view prefix = "var player_aaaa=";
+        if(js.compare(0,prefix.size(),prefix) == 0){
+            content = LXml::ToQString(js.substr(prefix.size()));
             break;
         }
     }
@@ -857,16 +1117,7 @@ void YsjdmProvider::videoPageReady(QNetworkReply *reply){
     if(url.endsWith("m3u8")){
         //Oh, it is a m3u8,we need to process it
         //Get the m3u8
-        QNetworkRequest request;
-        request.setUrl(QUrl(url));
-        request.setRawHeader("User-Agent",PLAYER_USERAGENT);
-        request.setRawHeader("Referer",reply->url().toString().toUtf8());
-
-        //Send it
-        auto rpy = manager->get(request);
-        connect(rpy,&QNetworkReply::finished,[rpy,this](){
-            m3u8Ready(rpy);
-        });
+        fetchM3U8(QUrl(url),reply->url().toString().toUtf8());
     }
     else{
         //Just play it
@@ -881,29 +1132,182 @@ void YsjdmProvider::videoPageReady(QNetworkReply *reply){
         emit videoReady(res);
     }
 }
-void YsjdmProvider::m3u8Ready(QNetworkReply *reply){
-    reply->deleteLater();
-    if(reply->error()){
-        emit error(reply->errorString());
+//--Race Provider
+RaceProvider::RaceProvider(QNetworkAccessManager *m,const QList<VideoProvider*> &providers) : VideoProvider(m){
+    provider_name = "Race";
+
+    for(int n = 0;n < providers.size();n++){
+        auto p = providers[n];
+        p->setParent(this);
+        //They run in background,a dialog of a loser would block the ui
+        p->setInteractive(false);
+
+        Runner runner;
+        runner.provider = p;
+        runners.push_back(runner);
+
+        connect(p,&VideoProvider::videoInfoReady,this,[this,n](const VideoInfo &info){
+            runnerInfoReady(n,info);
+        });
+        connect(p,&VideoProvider::videoReady,this,[this,n](const VideoResource &res){
+            runnerVideoReady(n,res);
+        });
+        connect(p,&VideoProvider::error,this,[this,n](const QString &msg){
+            runnerError(n,msg);
+        });
+    }
+}
+void RaceProvider::fetchInfo(const SeasonInfo &,int){
+    //The winner decides it
+    VideoInfo info;
+    info.need_pay.push_back(false);
+    info.resolutions.push_back("");
+    info.resolutions_name.push_back("Auto");
+    emit videoInfoReady(info);
+}
+void RaceProvider::fetchVideo(const SeasonInfo &s,int idx,QStringView){
+    season = s;
+    index = idx;
+    race += 1;
+    failed = 0;
+
+    //Start the historically fastest first,others are hedged
+    auto list = order();
+    quint64 cur = race;
+    for(int i = 0;i < list.size();i++){
+        int n = list[i];
+        runners[n].running = false;
+        QTimer::singleShot(i * PLAYER_RACE_HEDGE,this,[this,n,cur](){
+            //Not started in this race
+            if(cur == race && runners[n].race != race){
+                startRunner(n);
+            }
+        });
+    }
+}
+void RaceProvider::cancelPending(){
+    VideoProvider::cancelPending();
+    race += 1;
+    for(auto &runner : runners){
+        runner.running = false;
+        runner.provider->cancelPending();
+    }
+}
+void RaceProvider::startRunner(int n){
+    auto &runner = runners[n];
+    providerDebug() << "Race start" << runner.provider->name();
+
+    runner.running = true;
+    runner.race = race;
+    runner.started.start();
+    //Get the resolution first
+    runner.provider->fetchInfo(season,index);
+}
+void RaceProvider::runnerInfoReady(int n,const VideoInfo &info){
+    auto &runner = runners[n];
+    if(runner.race != race || !runner.running){
         return;
     }
-    //Check status code
-    if(reply->attribute(QNetworkRequest::HttpStatusCodeAttribute).toInt() != 200){
-        emit error("Status code not 200");
+    //Use the first one without need pay
+    QString resolution;
+    bool found = false;
+    for(int i = 0;i < info.resolutions.size() && i < info.need_pay.size();i++){
+        if(!info.need_pay[i]){
+            resolution = info.resolutions[i];
+            found = true;
+            break;
+        }
+    }
+    if(!found){
+        runnerError(n,"No free resolution");
         return;
     }
-    //Get the data
-    const auto &data = reply->readAll();
-    QString m3u8 = QString::fromUtf8(data);
-
-    VideoResource res;
-    if(parseEncrypedM3U8(m3u8,res)){
-        providerDebug() << "Got video : ";
-        emit videoReady(res);
+    runner.provider->fetchVideo(season,index,resolution);
+}
+void RaceProvider::runnerVideoReady(int n,const VideoResource &res){
+    auto &runner = runners[n];
+    if(runner.race != race || !runner.running){
+        return;
     }
-    else{
-        emit error("Invalid m3u8");
+    runner.running = false;
+    if(res.videos.isEmpty()){
+        runnerError(n,"Empty video");
+        return;
+    }
+    record(n,true);
+    providerDebug() << "Race won by" << runner.provider->name() << "in" << runner.started.elapsed() << "ms";
+
+    //Drop the rest,and stop their downloads (also the ones failed or not started in this race)
+    race += 1;
+    for(int i = 0;i < runners.size();i++){
+        runners[i].running = false;
+        if(i != n){
+            runners[i].provider->cancelPending();
+        }
+    }
+    emit videoReady(res);
+}
+void RaceProvider::runnerError(int n,const QString &msg){
+    auto &runner = runners[n];
+    if(runner.race != race || !runner.running){
+        return;
+    }
+    providerDebug() << "Race" << runner.provider->name() << "failed:" << msg;
+    runner.running = false;
+    record(n,false);
+
+    failed += 1;
+    if(failed == runners.size()){
+        race += 1;
+        emit error("所有Provider都失败了");
+        return;
+    }
+    //Do not wait the hedge delay,start the next one now
+    for(int next : order()){
+        if(runners[next].race != race){
+            startRunner(next);
+            break;
+        }
+    }
+}
+void RaceProvider::record(int n,bool ok){
+    auto &runner = runners[n];
+    QSettings settings;
+    settings.beginGroup("race/" + runner.provider->name());
+    settings.setValue("count",settings.value("count",0).toInt() + 1);
+    if(ok){
+        settings.setValue("success",settings.value("success",0).toInt() + 1);
+        settings.setValue("latency",settings.value("latency",0).toLongLong() + runner.started.elapsed());
+    }
+    settings.endGroup();
+}
+QList<int> RaceProvider::order() const{
+    //Score is the average latency divided by the success rate
+    QSettings settings;
+    QList<QPair<qreal,int>> scores;
+    for(int n = 0;n < runners.size();n++){
+        settings.beginGroup("race/" + runners[n].provider->name());
+        int count = settings.value("count",0).toInt();
+        int success = settings.value("success",0).toInt();
+        qint64 latency = settings.value("latency",0).toLongLong();
+        settings.endGroup();
+
+        qreal score = PLAYER_RACE_HEDGE;//< Unknown
+        if(count > 0){
+            qreal rate = qMax(qreal(success) / count,0.1);
+            qreal avg = success > 0 ? qreal(latency) / success : PLAYER_RACE_HEDGE * 4;
+            score = avg / rate;
+        }
+        scores.push_back(qMakePair(score,n));
+    }
+    std::stable_sort(scores.begin(),scores.end(),[](const QPair<qreal,int> &a,const QPair<qreal,int> &b){
+        return a.first < b.first;
+    });
+    QList<int> list;
+    for(auto &p : scores){
+        list.push_back(p.second);
     }
+    return list;
 }
 
 PLAYER_NS_END
\ No newline at end of file
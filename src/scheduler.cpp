@@ -0,0 +1,267 @@
+#include "common/scheduler.hpp"
+
+#include <QSslConfiguration>
+#include <QSettings>
+#include <QDebug>
+
+PLAYER_NS_BEGIN
+
+NetworkScheduler *NetworkScheduler::instance(){
+    static NetworkScheduler scheduler;
+    return &scheduler;
+}
+const char *NetworkScheduler::nameOf(Class c){
+    switch(c){
+        case Playback: return "Playback";
+        case Prefetch: return "Prefetch";
+        case Metadata: return "Metadata";
+        case Background: return "Background";
+        default: return "Unknown";
+    }
+}
+int NetworkScheduler::limitOf(Class c) const{
+    static const int limits[ClassCount] = {
+        PLAYER_NET_PLAYBACK_LIMIT,
+        PLAYER_NET_PREFETCH_LIMIT,
+        PLAYER_NET_METADATA_LIMIT,
+        PLAYER_NET_BACKGROUND_LIMIT
+    };
+    static const int shares[ClassCount] = {
+        100,
+        PLAYER_NET_PREFETCH_SHARE,
+        PLAYER_NET_METADATA_SHARE,
+        PLAYER_NET_BACKGROUND_SHARE
+    };
+    if(waiting == 0 || c == Playback){
+        return limits[c];
+    }
+    //Leave the connections to the playback starting
+    return qMax(1,limits[c] * shares[c] / 100);
+}
+QNetworkRequest NetworkScheduler::prepare(const QNetworkRequest &req,Class c) const{
+    QNetworkRequest request(req);
+    //Multiplexed on one connection if the server can
+    request.setAttribute(QNetworkRequest::Http2AllowedAttribute,true);
+    //Also the order in the queue of the connection
+    switch(c){
+        case Playback:
+            request.setPriority(QNetworkRequest::HighPriority);
+            break;
+        case Background:
+            request.setPriority(QNetworkRequest::LowPriority);
+            break;
+        default:
+            request.setPriority(QNetworkRequest::NormalPriority);
+            break;
+    }
+    return request;
+}
+QNetworkReply *NetworkScheduler::get(QNetworkAccessManager *manager,const QNetworkRequest &request,Class c,bool preemptible){
+    auto reply = manager->get(prepare(request,c));
+    track(reply,c,preemptible,QSharedPointer<Job>());
+    return reply;
+}
+QNetworkReply *NetworkScheduler::post(QNetworkAccessManager *manager,const QNetworkRequest &request,const QByteArray &data,Class c){
+    auto reply = manager->post(prepare(request,c),data);
+    track(reply,c,false,QSharedPointer<Job>());
+    return reply;
+}
+void NetworkScheduler::enqueue(QNetworkAccessManager *manager,const QNetworkRequest &request,Class c,QObject *context,Started started){
+    QSharedPointer<Job> job(new Job{manager,request,c,context,started});
+    queues[c].push_back(job);
+    schedule();
+}
+void NetworkScheduler::promote(QNetworkReply *reply,Class c){
+    auto iter = running.find(reply);
+    if(iter == running.end()){
+        return;
+    }
+    setWaiting(iter.value(),-1);
+    counts[iter->cls] -= 1;
+    counts[c] += 1;
+    iter->cls = c;
+    iter->preemptible = false;
+    setWaiting(iter.value(),1);
+    if(c == Playback && waiting > 0){
+        preempt();
+    }
+}
+void NetworkScheduler::setStage(QNetworkRequest &request,const QString &stage){
+    request.setAttribute(QNetworkRequest::User,stage);
+}
+void NetworkScheduler::track(QNetworkReply *reply,Class c,bool preemptible,QSharedPointer<Job> job){
+    Running r{c,preemptible,job,QElapsedTimer(),reply->request().attribute(QNetworkRequest::User).toString()};
+    if(r.stage.isEmpty()){
+        r.stage = nameOf(c);
+    }
+    r.timer.start();
+    running.insert(reply,r);
+    counts[c] += 1;
+    setWaiting(r,1);
+    started[c] += 1;
+    //Connected before the owner,so the owner see the preempted property
+    connect(reply,&QNetworkReply::finished,this,[this,reply](){
+        untrack(reply);
+    });
+    //Headers are the first bytes
+    connect(reply,&QNetworkReply::metaDataChanged,this,[this,reply](){
+        firstByte(reply);
+    });
+    if(c == Playback){
+        preempt();
+    }
+}
+void NetworkScheduler::untrack(QNetworkReply *reply){
+    auto iter = running.find(reply);
+    if(iter == running.end()){
+        return;
+    }
+    Running r = iter.value();
+    running.erase(iter);
+    counts[r.cls] -= 1;
+    setWaiting(r,-1);
+
+    if(isPreempted(reply) && !r.job.isNull()){
+        //Send it again when the playback is done
+        queues[r.job->cls].push_front(r.job);
+    }
+    schedule();
+    emit available();
+}
+void NetworkScheduler::firstByte(QNetworkReply *reply){
+    auto iter = running.find(reply);
+    if(iter == running.end() || !iter->timer.isValid()){
+        return;
+    }
+    qint64 ttfb = iter->timer.elapsed();
+    //Only the first time
+    setWaiting(iter.value(),-1);
+    iter->timer.invalidate();
+
+    auto &t = timings[iter->stage];
+    t.count += 1;
+    t.total += ttfb;
+    t.max = qMax(t.max,ttfb);
+
+    if(iter->cls == Playback && waiting == 0){
+        //Started,the lower classes get their slots back
+        schedule();
+        emit available();
+    }
+}
+void NetworkScheduler::setWaiting(const Running &r,int delta){
+    if(r.cls != Playback || !r.timer.isValid()){
+        return;
+    }
+    waiting += delta;
+}
+void NetworkScheduler::preempt(){
+    for(Class c : {Background,Prefetch}){
+        int over = counts[c] - limitOf(c);
+        if(over <= 0){
+            continue;
+        }
+        QList<QNetworkReply*> victims;
+        for(auto iter = running.begin();iter != running.end() && victims.size() < over;++iter){
+            if(iter->cls == c && iter->preemptible){
+                victims.push_back(iter.key());
+            }
+        }
+        for(auto reply : victims){
+            mplayerDebug() << "Preempt" << nameOf(c) << reply->url();
+            preempted[c] += 1;
+            reply->setProperty("preempted",true);
+            reply->abort();
+        }
+    }
+}
+void NetworkScheduler::schedule(){
+    for(int i = 0;i < ClassCount;i++){
+        Class c = Class(i);
+        while(!queues[c].isEmpty() && canStart(c)){
+            auto job = queues[c].takeFirst();
+            if(job->context == nullptr || job->manager == nullptr){
+                continue;
+            }
+            auto reply = job->manager->get(prepare(job->request,c));
+            track(reply,c,true,job);
+            job->started(reply);
+        }
+    }
+}
+QString NetworkScheduler::stats() const{
+    QString text;
+    for(int i = 0;i < ClassCount;i++){
+        text += QString("%1: %2 running,%3 queued,%4 sent,%5 preempted\n")
+            .arg(nameOf(Class(i)))
+            .arg(counts[i])
+            .arg(queues[i].size())
+            .arg(started[i])
+            .arg(preempted[i]);
+    }
+    text += "TTFB:\n";
+    for(auto iter = timings.begin();iter != timings.end();++iter){
+        text += QString("%1: avg %2 ms,max %3 ms,%4 requests\n")
+            .arg(iter.key())
+            .arg(iter->total / iter->count)
+            .arg(iter->max)
+            .arg(iter->count);
+    }
+    return text;
+}
+
+//--ConnectionWarmer
+ConnectionWarmer *ConnectionWarmer::instance(){
+    static ConnectionWarmer warmer;
+    return &warmer;
+}
+void ConnectionWarmer::warm(QNetworkAccessManager *manager){
+    warmHost(manager,QUrl("https://api.bilibili.com"));
+    warmHost(manager,QUrl("https://comment.bilibili.com"));
+
+    QSettings settings;
+    for(const auto &host : settings.value("network/video_hosts").toStringList()){
+        warmHost(manager,QUrl(host));
+    }
+}
+void ConnectionWarmer::warmHost(QNetworkAccessManager *manager,const QUrl &origin){
+    auto iter = warmed.find(origin);
+    if(iter != warmed.end() && iter->elapsed() < PLAYER_WARM_INTERVAL){
+        return;
+    }
+    warmed[origin].start();
+
+    if(origin.scheme() == "https"){
+        //Offer h2,or the connection can not be used by the requests allowing HTTP/2
+        QSslConfiguration conf = QSslConfiguration::defaultConfiguration();
+        conf.setAllowedNextProtocols({QSslConfiguration::ALPNProtocolHTTP2,QSslConfiguration::NextProtocolHttp1_1});
+        manager->connectToHostEncrypted(origin.host(),origin.port(443),conf);
+    }
+    else{
+        manager->connectToHost(origin.host(),origin.port(80));
+    }
+}
+void ConnectionWarmer::remember(const QUrl &url){
+    if(url.isLocalFile() || url.host().isEmpty()){
+        return;
+    }
+    QUrl origin;
+    origin.setScheme(url.scheme());
+    origin.setHost(url.host());
+    origin.setPort(url.port());
+    QString str = origin.toString();
+
+    QSettings settings;
+    auto hosts = settings.value("network/video_hosts").toStringList();
+    if(!hosts.isEmpty() && hosts.first() == str){
+        return;
+    }
+    hosts.removeAll(str);
+    hosts.prepend(str);
+    while(hosts.size() > PLAYER_WARM_HOSTS){
+        hosts.removeLast();
+    }
+    settings.setValue("network/video_hosts",hosts);
+}
+
+PLAYER_NS_END